@@ -58,4 +58,11 @@ void balloc_get_free_range(size_t i, struct balloc_range *range);
 
 uintptr_t balloc_phys_mem(void);
 
+/**
+ * Range reserved for the contiguous memory allocator (see cma.h), empty
+ * (begin == end) if there was not enough memory. It's not among free
+ * ranges, the buddy allocator gives it to movable allocations only.
+ **/
+void balloc_cma_range(struct balloc_range *range);
+
 #endif /*__BOOTSTRAP_ALLOCATOR_H__*/
@@ -4,31 +4,225 @@
 #include <memory.h>
 #include <list.h>
 
-/* Maximum possible allocation size 2^20 pages */
-#define MAX_ORDER	20
+#include <stddef.h>
+#include <stdint.h>
 
+/**
+ * Upper bound of the allocation order (2^30 pages, 4TB) we size arrays
+ * with. Blocks can't be larger than the largest zone, so the actual limit
+ * depends on the memory size, see buddy_max_order.
+ **/
+#define MAX_ORDER	30
+
+/**
+ * Pages are grouped by mobility in pageblocks of 2^PAGEBLOCK_ORDER pages
+ * (the size of a large page), so that pages we can't move or reclaim
+ * don't end up scattered all over the memory and large blocks remain
+ * available.
+ **/
+#define PAGEBLOCK_ORDER	9
+
+enum migrate_type {
+	MIGRATE_UNMOVABLE,
+	MIGRATE_MOVABLE,
+	MIGRATE_RECLAIMABLE,
+	MIGRATE_PCPTYPES,
+
+	/* pageblocks of the CMA region, only movable pages can borrow them */
+	MIGRATE_CMA = MIGRATE_PCPTYPES,
+	/* pageblocks being compacted, free pages there are not allocated */
+	MIGRATE_ISOLATE,
+	MIGRATE_TYPES
+};
+
+/**
+ * Memory below 4GB forms DMA32 zones for devices that can't address more
+ * (see buddy_alloc_range), the rest is NORMAL. Allocations without
+ * constraints prefer NORMAL zones and leave a reserve in DMA32 zones.
+ **/
+enum zone_type {
+	ZONE_DMA32,
+	ZONE_NORMAL,
+	ZONE_TYPES
+};
+
+#define BUDDY_DMA32_LIMIT	((uintptr_t)1 << 32)
+
+/**
+ * Page descriptor takes only 16 bytes: free blocks are linked in lists
+ * by 32-bit offsets from the zone begin instead of pointers (so a zone
+ * can't be larger than 16TB, larger memory ranges take a few zones) and
+ * the order of a free block is packed into flags with the rest of the
+ * state. Links of busy pages are not used by
+ * the buddy allocator, so the owner of the pages might keep a pointer
+ * sized value there (see page_private).
+ **/
 struct page {
-	struct list_head ll;
+	uint32_t next;
+	uint32_t prev;
 	unsigned long flags;
-	int order;
 };
 
 
+/**
+ * Descriptors of all physical pages form one virtually contiguous array
+ * indexed by the page frame number (PFN), starting at MEMMAP_BASE. Only
+ * parts of the array describing existing physical memory are actually
+ * mapped, so holes in the physical address space cost us nothing.
+ **/
+#define memmap	((struct page *)MEMMAP_BASE)
+
+
+/* Allocation flags */
+#define BUDDY_ZERO	(1u << 0)	/* fill allocated memory with zeroes */
+#define BUDDY_MOVABLE	(1u << 1)	/* memory can be moved (user pages) */
+#define BUDDY_RECLAIMABLE	(1u << 2)	/* memory can be freed on demand */
+
+/* Allocations without mobility flags are unmovable. */
+
+
+/**
+ * buddy_setup initializes only memory we need to boot, the rest is
+ * initialized by a background thread started by buddy_init_late, that
+ * must be called after scheduler_setup.
+ **/
 void buddy_setup(void);
+void buddy_init_late(void);
+
+/* The largest order buddy allocator can satisfy, known after setup. */
+int buddy_max_order(void);
 
 /**
  * Buddy alloc/free routines are given in two versions:
  *  - one returns descriptor (struct page)
  *  - other resutrns physical address
  **/
-struct page *__buddy_alloc(int order);
-uintptr_t buddy_alloc(int order);
+struct page *__buddy_alloc(int order, unsigned flags);
+uintptr_t buddy_alloc(int order, unsigned flags);
 void __buddy_free(struct page *page, int order);
 void buddy_free(uintptr_t phys, int order);
 
+/**
+ * Allocates a block that ends at or below max_phys (e.g. BUDDY_DMA32_LIMIT)
+ * for devices with limited addressing. These are much slower than regular
+ * allocations since they have to look through free lists. Blocks are
+ * freed by the regular buddy_free.
+ **/
+struct page *__buddy_alloc_range(int order, unsigned flags,
+			uintptr_t max_phys);
+uintptr_t buddy_alloc_range(int order, unsigned flags, uintptr_t max_phys);
+
+/**
+ * Bulk versions allocate/free count blocks of the same order taking
+ * every lock only once per batch instead of once per block. Allocation
+ * routines return number of blocks actually allocated, which might be
+ * less than requested if there is not enough memory.
+ **/
+size_t __buddy_alloc_bulk(int order, unsigned flags, size_t count,
+			struct page **pages);
+size_t buddy_alloc_bulk(int order, unsigned flags, size_t count,
+			uintptr_t *phys);
+void __buddy_free_bulk(int order, size_t count, struct page **pages);
+void buddy_free_bulk(int order, size_t count, const uintptr_t *phys);
+
+/**
+ * Single pages for BUDDY_ZERO allocations are taken from a pool of pages
+ * zeroed in advance. The pool is refilled by the idle thread: the
+ * function zeroes one more page for the pool and returns non zero if
+ * there was anything to do.
+ **/
+int buddy_zero_refill(void);
+
+struct buddy_zero_stats {
+	unsigned long hits;
+	unsigned long misses;
+	int pages;
+};
+
+void buddy_zero_stats(struct buddy_zero_stats *stats);
+
+/**
+ * Memory compaction support (see compact.c). Compaction isolates a few
+ * movable pageblocks with only a handful of busy pages, so that pages
+ * freed there are not allocated again, moves busy pages somewhere else
+ * and then releases the pageblocks, hopefully completely free.
+ *
+ * buddy_isolate_blocks returns number of pageblocks isolated (up to
+ * count), buddy_release_blocks returns how many of them are free.
+ **/
+#define BUDDY_ISOLATE_MAX	16
+
+size_t buddy_isolate_blocks(struct page **blocks, size_t count);
+size_t buddy_release_blocks(struct page **blocks, size_t count);
+int buddy_page_isolated(const struct page *page);
+
+/* Number of free pageblocks inside free blocks of PAGEBLOCK_ORDER or more */
+size_t buddy_free_blocks(void);
+
+/**
+ * Contiguous memory allocator support (see cma.h), all ranges are given
+ * by physical addresses and must lie inside one zone.
+ *
+ * buddy_set_range_type changes type of the pageblocks of the range (must
+ * be pageblock aligned) and moves free blocks there to the new lists,
+ * isolating a range also returns pages cached by per-CPU lists to zones.
+ * buddy_take_range removes pages of the range from free lists if all of
+ * them are free and returns non zero, otherwise it changes nothing.
+ * buddy_free_range gives pages of the range back.
+ **/
+void buddy_set_range_type(uintptr_t begin, uintptr_t end, int type);
+int buddy_take_range(uintptr_t begin, uintptr_t end);
+void buddy_free_range(uintptr_t begin, uintptr_t end);
+
+/**
+ * Every zone has three watermarks: allocations don't take a zone below
+ * min unless they failed even after reclaim, below low the background
+ * reclaim thread is woken up and works until zones are above high (see
+ * reclaim.h). buddy_watermark_deficit returns how many pages zones lack
+ * to get above the given watermark.
+ **/
+enum watermark {
+	WMARK_MIN,
+	WMARK_LOW,
+	WMARK_HIGH,
+	WMARK_COUNT
+};
+
+size_t buddy_watermark_deficit(int mark);
+
+/**
+ * Prints per zone and per order statistics (free blocks, allocations,
+ * frees, splits, merges and unusable free space index) followed by
+ * the number of failed allocations of every order and zero pool size,
+ * hits and misses. Used to generate /proc/buddyinfo, or prints to the
+ * console if file is 0.
+ **/
+struct file;
+
+void buddy_show(struct file *file);
+
+/**
+ * Measures cycles per alloc/free pair of a single page with and without
+ * per-CPU lists for a few burst sizes (pages allocated before they are
+ * freed). Used to generate /proc/buddybench.
+ **/
+void buddy_bench_show(struct file *file);
+
 
 /* Convertion routines: descriptor to physical address and vice versa. */
-uintptr_t page_addr(const struct page *page);
-struct page *addr_page(uintptr_t phys);
+static inline uintptr_t page_addr(const struct page *page)
+{ return (uintptr_t)(page - memmap) << PAGE_BITS; }
+
+static inline struct page *addr_page(uintptr_t phys)
+{ return &memmap[phys >> PAGE_BITS]; }
+
+static inline uintptr_t page_private(const struct page *page)
+{ return ((uintptr_t)page->prev << 32) | page->next; }
+
+static inline void page_set_private(struct page *page, uintptr_t data)
+{
+	page->next = (uint32_t)data;
+	page->prev = (uint32_t)(data >> 32);
+}
 
 #endif /*__BUDDY_H__*/
@@ -0,0 +1,24 @@
+#ifndef __CMA_H__
+#define __CMA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Contiguous memory allocator gives out physically contiguous ranges of
+ * pages of any size (not only 2^i) from a region reserved during boot
+ * (see balloc_cma_range). While the region is idle movable user pages
+ * borrow it, cma_alloc moves them out of the way. It makes a bounded
+ * number of attempts and returns 0 if it fails, e.g. when the region is
+ * exhausted or there is no memory to move pages to.
+ *
+ * cma_alloc might sleep, so it must be called from a thread. Ranges are
+ * freed by cma_free with the same number of pages.
+ **/
+uintptr_t cma_alloc(size_t pages);
+void cma_free(uintptr_t phys, size_t pages);
+
+void cma_setup(void);
+
+#endif /*__CMA_H__*/
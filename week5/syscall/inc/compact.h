@@ -0,0 +1,49 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Compaction moves movable user pages around to get free pageblocks
+ * (2MB), that are required for large page mappings. It's done either
+ * on demand or by a background thread, when free pageblocks run low.
+ **/
+struct compact_stats {
+	unsigned long runs;
+	unsigned long blocks;	/* pageblocks recovered */
+	unsigned long pages;	/* pages moved */
+	uint64_t cycles;	/* TSC cycles spent */
+
+	/* the same for the last run only */
+	unsigned long last_blocks;
+	unsigned long last_pages;
+	uint64_t last_cycles;
+};
+
+/* Tries to get blocks free pageblocks, returns number of recovered. */
+size_t compact_memory(size_t blocks);
+
+/**
+ * Tries to get one free pageblock for an allocation that just failed,
+ * returns non zero on success. If it fails a few following calls will
+ * not even try.
+ **/
+int compact_direct(void);
+
+/* Buddy allocator calls it to wake up the background thread if needed. */
+void compact_wakeup(void);
+
+void compact_stats(struct compact_stats *stats);
+
+/**
+ * Prints compaction statistics (see struct compact_stats). Used to
+ * generate /proc/compactinfo, or prints to the console if file is 0.
+ **/
+struct file;
+
+void compact_show(struct file *file);
+void compact_setup(void);
+
+#endif /*__COMPACT_H__*/
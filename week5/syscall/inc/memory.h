@@ -7,8 +7,29 @@
 /* First address after "canonical hole", beginning of the middle mapping. */
 #define HIGHER_BASE	0xffff800000000000
 
-/* It's where userpsace area ends */
-#define USERSPACE_END	0x0000800000000000
+/* Physical memory beyond this size is not mapped at HIGHER_BASE, 73TB */
+#define DIRECT_MAP_SIZE	0x490000000000
+
+/* Virtually contiguous kernel allocations (see vmalloc.h), 1TB */
+#define VMALLOC_BASE	0xffffc90000000000
+#define VMALLOC_END	0xffffca0000000000
+
+/* Page descriptors of the whole physical memory (see buddy.h) */
+#define MEMMAP_BASE	0xffffea0000000000
+
+/**
+ * bootstrap.S maps only this much of the physical memory at HIGHER_BASE,
+ * paging_setup maps the rest.
+ **/
+#define BOOTSTRAP_MAP_SIZE	0x100000000
+
+/**
+ * It's where userpsace area ends. With 5-level paging a process can use
+ * addresses up to USERSPACE_LA57_END, but only if it asks for them
+ * explicitly (see mmap), everything else stays below USERSPACE_END.
+ **/
+#define USERSPACE_END		0x0000800000000000
+#define USERSPACE_LA57_END	0x0100000000000000
 
 /* Kernel 64 bit code and data segment selectors. */
 #define KERNEL_CS	0x08
@@ -3,6 +3,7 @@
 
 #include <buddy.h>
 #include <list.h>
+#include <mutex.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -27,7 +28,14 @@ struct vma {
 };
 
 struct mm {
-	/* list of mapped region descriptors */
+	/* all address spaces are linked together (see mm_migrate) */
+	struct list_head ll;
+
+	/**
+	 * list of mapped region descriptors, the lock protects it and page
+	 * tables from changes while we map/unmap or migrate pages
+	 **/
+	struct mutex lock;
 	struct list_head vmas;
 
 	/* root page table */
@@ -43,7 +51,11 @@ struct mm *mm_create(void);
 void mm_release(struct mm *mm);
 int mm_copy(struct mm *dst, struct mm *src);
 
-/* Create/delete mapping with given permissons */
+/**
+ * Create/delete mapping with given permissons. With 5-level paging
+ * mappings might go above USERSPACE_END up to USERSPACE_LA57_END, but
+ * only if a process asks for such addresses explicitly.
+ **/
 int mmap(struct mm *mm, uintptr_t from, uintptr_t to, unsigned perm);
 int munmap(struct mm *mm, uintptr_t from, uintptr_t to);
 
@@ -53,6 +65,13 @@ int mcopy(struct mm *dst, uintptr_t to, struct mm *src, uintptr_t from,
 /* Fill data in the other process address space */
 int mset(struct mm *dst, uintptr_t to, int c, size_t size);
 
+/**
+ * Moves user pages, for which move returns non zero, in all address
+ * spaces to other places in memory (see pt_migrate). Returns number of
+ * moved pages.
+ **/
+size_t mm_migrate(int (*move)(const struct page *));
+
 void mm_setup(void);
 
 #endif /*__MM_H__*/
@@ -22,6 +22,8 @@ struct mutex {
 void mutex_setup(struct mutex *mutex);
 
 void mutex_lock(struct mutex *mutex);
+/* Returns non zero if the mutex was acquired, never blocks. */
+int mutex_trylock(struct mutex *mutex);
 void mutex_unlock(struct mutex *mutex);
 
 #endif /*__MUTEX_H__*/
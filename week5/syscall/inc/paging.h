@@ -15,9 +15,24 @@ typedef uint64_t	pte_t;
 #define PTE_WRITE	((pte_t)1 << 1)
 #define PTE_USER	((pte_t)1 << 2)
 
+#define CR4_LA57	((uintptr_t)1 << 12)
+
 
 extern uintptr_t initial_cr3;
 
+/**
+ * Number of page table levels: 5 if the CPU supports LA57 (bootstrap.S
+ * turns it on), 4 otherwise. Routines below that take pml4 actually take
+ * the root table, whatever level it is.
+ **/
+extern int pt_levels;
+
+/* The end of the user part of the address space we can use. */
+static inline uintptr_t pt_user_end(void)
+{
+	return pt_levels == 5 ? USERSPACE_LA57_END : USERSPACE_END;
+}
+
 
 size_t pt_index(uintptr_t addr, int lvl);
 uintptr_t pt_addr(const pte_t *pml4, uintptr_t virt_addr);
@@ -25,6 +40,59 @@ uintptr_t pt_addr(const pte_t *pml4, uintptr_t virt_addr);
 int pt_map(pte_t *pml4, uintptr_t vaddr, size_t size, pte_t flags);
 void pt_unmap(pte_t *pml4, uintptr_t vaddr, size_t size);
 
+/**
+ * Kernel counterparts of the above for the vmalloc area: pt_map_kernel
+ * maps count given pages one after another at vaddr in the initial page
+ * table, allocating internal tables as needed (returns -1 and maps
+ * nothing if we run out of memory). pt_unmap_kernel clears mappings of
+ * count pages and returns what they mapped in pages, TLB is left for the
+ * caller to flush.
+ *
+ * Address spaces copy the upper half of the root table when created (see
+ * mm_create), so tables of the top levels must exist before that. That's
+ * what pt_prepare_kernel does for the given range.
+ **/
+int pt_prepare_kernel(uintptr_t vaddr, size_t size);
+int pt_map_kernel(uintptr_t vaddr, size_t count, const uintptr_t *pages,
+			pte_t flags);
+void pt_unmap_kernel(uintptr_t vaddr, size_t count, uintptr_t *pages);
+
+struct page;
+
+/**
+ * Walks the user part of the page table and moves every 4KB page, for
+ * which move returns non zero, to a new movable page updating the page
+ * table entry (flush tells if the page table is in use, so TLB must be
+ * flushed as well). Used by compaction, returns -1 if we run out of
+ * memory, number of moved pages is added to moved anyway.
+ **/
+int pt_migrate(pte_t *pml4, int (*move)(const struct page *), int flush,
+			size_t *moved);
+
+/**
+ * Maps [phys; phys + size) at virt in the initial page table using the
+ * bootstrap allocator for the internal page tables. It's only usable
+ * before the buddy allocator is up and only for the kernel part of the
+ * address space (all processes share it, see mm_create).
+ **/
+void pt_map_early(uintptr_t virt, size_t size, uintptr_t phys, pte_t flags);
+
+
+static inline uintptr_t cr4_read(void)
+{
+	uintptr_t cr4;
+
+	__asm__ volatile ("movq %%cr4, %0" : "=r"(cr4));
+	return cr4;
+}
+
+static inline uintptr_t cr3_read(void)
+{
+	uintptr_t cr3;
+
+	__asm__ volatile ("movq %%cr3, %0" : "=r"(cr3));
+	return cr3;
+}
 
 static inline void cr3_write(uintptr_t phys)
 {
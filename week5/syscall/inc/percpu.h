@@ -0,0 +1,111 @@
+#ifndef __PERCPU_H__
+#define __PERCPU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lock.h>
+
+
+/* We support only one CPU so far, but per-CPU data doesn't depend on it. */
+#define NR_CPUS	1
+
+#define for_each_cpu(cpu)	for (int cpu = 0; cpu != NR_CPUS; ++cpu)
+
+
+/**
+ * Static per-CPU variables live in the .percpu section, that serves as
+ * a template of the per-CPU area: every CPU has its own copy of the
+ * section at percpu_offset[cpu] from the template and the GS base of
+ * the CPU points to the copy. The boot CPU uses the template itself as
+ * it needs per-CPU data (e.g. preempt count) before any allocator works.
+ *
+ * Variables are defined with DEFINE_PER_CPU(type, name) and accessed
+ * with this_cpu_* (or per_cpu for a given CPU), never directly, since
+ * the address of the variable is the address of the template copy.
+ **/
+#define DEFINE_PER_CPU(type, name) \
+	__attribute__((section(".percpu"))) __typeof__(type) name
+#define DECLARE_PER_CPU(type, name) \
+	extern __attribute__((section(".percpu"))) __typeof__(type) name
+
+extern uintptr_t percpu_offset[NR_CPUS];
+
+/* The first variable of the area is its offset, see percpu.c */
+static inline uintptr_t this_cpu_offset(void)
+{
+	uintptr_t offs;
+
+	__asm__ ("movq %%gs:0, %0" : "=r"(offs));
+	return offs;
+}
+
+/**
+ * Pointers work for both static variables (&var) and per-CPU memory from
+ * percpu_alloc. Code that uses them must not be preempted (and moved to
+ * another CPU) in the middle, unless it can tolerate that.
+ **/
+#define per_cpu_ptr(ptr, cpu) \
+	((__typeof__(ptr))((uintptr_t)(ptr) + percpu_offset[(cpu)]))
+#define this_cpu_ptr(ptr) \
+	((__typeof__(ptr))((uintptr_t)(ptr) + this_cpu_offset()))
+
+#define per_cpu(var, cpu)	(*per_cpu_ptr(&(var), (cpu)))
+#define this_cpu_read(var)	(*this_cpu_ptr(&(var)))
+#define this_cpu_write(var, val)	(*this_cpu_ptr(&(var)) = (val))
+#define this_cpu_add(var, val)	(*this_cpu_ptr(&(var)) += (val))
+#define this_cpu_inc(var)	this_cpu_add(var, 1)
+#define this_cpu_dec(var)	this_cpu_add(var, -1)
+
+
+/**
+ * Dynamic per-CPU memory: percpu_alloc returns zeroed memory with a copy
+ * for every CPU (access it with this_cpu_ptr/per_cpu_ptr) or 0. The
+ * first chunk is a part of the static area and works right after
+ * percpu_setup, more chunks of PERCPU_CHUNK_SIZE bytes are allocated on
+ * demand once vmalloc works, so an allocation can't be larger than that.
+ * Both might sleep.
+ **/
+#define PERCPU_CHUNK_SIZE	((size_t)1 << 16)
+
+void *percpu_alloc(size_t size, size_t align);
+void percpu_free(void *ptr);
+
+
+/**
+ * Per-CPU counter: updates touch only the counter of the current CPU
+ * without any shared cache lines or disabling interrupts, a CPU folds its
+ * part into the shared count only when it goes beyond batch (so the
+ * counter doesn't overflow) and readers sum all parts up, so reads are
+ * expensive. Use it for statistics that change often and are read rarely.
+ *
+ * percpu_counter_setup returns non zero if there is not enough memory.
+ **/
+struct percpu_counter {
+	struct spinlock lock;
+	long count;
+	long batch;
+	long *counters;
+};
+
+#define PERCPU_COUNTER_BATCH	(1l << 20)
+
+int percpu_counter_setup(struct percpu_counter *counter, long batch);
+void percpu_counter_release(struct percpu_counter *counter);
+void percpu_counter_add(struct percpu_counter *counter, long delta);
+long percpu_counter_sum(struct percpu_counter *counter);
+
+static inline void percpu_counter_inc(struct percpu_counter *counter)
+{ percpu_counter_add(counter, 1); }
+
+static inline void percpu_counter_dec(struct percpu_counter *counter)
+{ percpu_counter_add(counter, -1); }
+
+
+/**
+ * Sets up GS base of the boot CPU, must be called before anything else
+ * since even spinlocks need per-CPU data.
+ **/
+void percpu_setup(void);
+
+#endif /*__PERCPU_H__*/
@@ -0,0 +1,13 @@
+#ifndef __PROC_H__
+#define __PROC_H__
+
+
+/**
+ * The function creates ramfs files (under proc/ prefix) exposing
+ * kernel statistics, content of such files is generated every time
+ * they are opened.
+ **/
+
+void proc_setup(void);
+
+#endif /*__PROC_H__*/
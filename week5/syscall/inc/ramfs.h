@@ -19,6 +19,11 @@ struct file {
 	char name[RAMFS_MAX_NAME + 1];
 
 	struct list_head data;
+
+	/* if set, generates the file content on every open */
+	void (*show)(struct file *file);
+	/* number of times the file is open */
+	int refs;
 };
 
 
@@ -29,6 +34,17 @@ void ramfs_close(struct file *file);
 long ramfs_readat(struct file *file, void *data, long size, long offs);
 long ramfs_writeat(struct file *file, const void *data, long size, long offs);
 
+/**
+ * Files created with ramfs_create_show don't keep anything written to
+ * them, instead the content is regenerated by show every time the file
+ * is opened. Inside show the content is written with ramfs_printf, that
+ * prints to the console if the file is 0, so the same routine can dump
+ * the information to the console as well. Content of such files that
+ * are not open is dropped on memory pressure.
+ **/
+int ramfs_create_show(const char *name, void (*show)(struct file *));
+int ramfs_printf(struct file *file, const char *fmt, ...);
+
 void ramfs_setup(void); 
 
 #endif /*__RAMFS_H__*/
@@ -0,0 +1,37 @@
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include <stddef.h>
+
+#include <list.h>
+
+
+/**
+ * Caches that can give memory back on demand (empty slabs, zeroed pages
+ * and so on) register a shrinker. When free memory of a zone drops below
+ * the low watermark the background reclaim thread calls shrinkers until
+ * all zones are above the high watermark, and an allocation that would
+ * take a zone below the min watermark calls them directly.
+ *
+ * shrink is called from allocation paths, possibly with interrupts
+ * disabled, so it must not sleep: a shrinker that needs a mutex should
+ * skip the work if the mutex is busy. It's asked to free the given number
+ * of pages and returns number of pages actually freed.
+ **/
+struct shrinker {
+	struct list_head ll;
+	size_t (*shrink)(struct shrinker *shrinker, size_t pages);
+};
+
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+
+/* Calls shrinkers until pages are freed, returns number of pages freed. */
+size_t reclaim_pages(size_t pages);
+
+/* Buddy allocator calls it to wake up the background thread if needed. */
+void reclaim_wakeup(void);
+
+void reclaim_setup(void);
+
+#endif /*__RECLAIM_H__*/
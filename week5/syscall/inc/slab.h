@@ -5,33 +5,176 @@
 
 #include <lock.h>
 #include <list.h>
+#include <percpu.h>
+#include <reclaim.h>
 
 /**
- * This is a simplified version of classical SLAB allocator algorithm.
- * Simplified because we dropped some of the optimisation described in
- * the original paper, specifically:
- *  - cache coloring
- *  - constructors/destructors
+ * This is a version of classical SLAB allocator algorithm with cache
+ * colouring and constructors/destructors. Constructor is called for every
+ * object when a new slab is created and destructor when the slab is
+ * released, so objects must be returned to the cache in the constructed
+ * state and a free/alloc cycle doesn't need to initialize them again.
+ *
+ * On top of slabs every cache has a per-CPU layer of magazines and a
+ * depot of magazines (see slab.c), or, in the lockless mode, the CPU owns
+ * a whole slab and takes objects from it without locks (like SLUB).
  **/
+struct slab_magazine;
+struct slab;
+
+/**
+ * Free objects of the CPU slab in the lockless mode. Head and transaction
+ * id are updated together by cmpxchg16b, and the id changes with every
+ * update, so an operation interrupted half way just fails and retries.
+ **/
+struct slab_cpu_freelist {
+	void *head;
+	unsigned long tid;
+} __attribute__((aligned(16)));
+
+/* We support only one CPU so far, so every cache has only one of these. */
+struct slab_cpu {
+	struct slab_magazine *loaded;
+	struct slab_magazine *previous;
+
+	struct slab_cpu_freelist freelist;
+	struct slab *slab;
+
+	/* operations served (hits) and not served (misses) by magazines */
+	unsigned long alloc_hits;
+	unsigned long alloc_misses;
+	unsigned long free_hits;
+	unsigned long free_misses;
+};
+
+struct slab_depot {
+	struct list_head full;
+	struct list_head empty;
+
+	/* size class of new magazines or -1 if magazines aren't used */
+	int mag_class;
+	unsigned long window;
+	unsigned long visits;
+};
+
+/* Cache statistics, see slab_show. */
+struct slab_stats {
+	struct percpu_counter allocs;	/* objects given out */
+	struct percpu_counter frees;	/* objects given back */
+	unsigned long created;		/* slabs created */
+	unsigned long destroyed;	/* slabs destroyed */
+
+	/* number of slabs on every list */
+	unsigned long full;
+	unsigned long partial;
+	unsigned long empty;
+};
 
 struct slab_cache {
+	const char *name;
+	/* all caches are linked in one registry */
+	struct list_head link;
+
 	struct spinlock lock;
 	struct list_head full;
 	struct list_head partial;
 	struct list_head empty;
 
+	unsigned flags;
 	int slab_order;
 	size_t slab_size;
 	size_t obj_size;
+	/* slab descriptors are allocated separately */
+	int off_slab;
+
+	/* offset of the free list link inside a free object */
+	size_t link_offs;
+	void (*ctor)(void *obj);
+	void (*dtor)(void *obj);
+
+	/* objects of a new slab start at colour_next * colour_step offset */
+	size_t colour_step;
+	size_t colours;
+	size_t colour_next;
+
+	struct slab_cpu cpu;
+	struct slab_depot depot;
+
+	/* every cache gives empty slabs back on memory pressure */
+	struct shrinker shrinker;
+	/* and the reaper periodically destroys empty slabs above reap_keep */
+	size_t reap_keep;
+
+	struct slab_stats stats;
 };
 
 
-void __slab_cache_setup(struct slab_cache *cache, size_t size, size_t align);
-void slab_cache_setup(struct slab_cache *cache, size_t size);
+/**
+ * General purpose allocator: small sizes are served by caches of power of
+ * two sizes (8 bytes to 8KB), larger by the buddy allocator directly. kfree
+ * finds the cache by the page descriptor of the pointer.
+ **/
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+/* Must be called before any cache is set up. */
+void slab_setup(void);
+
+/**
+ * Starts the reaper thread, that every SLAB_REAP_TICKS timer ticks
+ * destroys empty slabs every cache keeps above its reap_keep limit (see
+ * slab.c). Must be called after scheduler_setup.
+ **/
+void slab_reap_setup(void);
+
+/**
+ * Prints statistics of all caches (objects in use, slabs on every list,
+ * allocations, frees, slabs created and destroyed, operations served and
+ * not served by magazines and the percentage served). Used to generate
+ * /proc/slabinfo, or prints to the console if file is 0.
+ **/
+struct file;
+
+void slab_show(struct file *file);
+
+/**
+ * Measures cycles per read of the first objects of many slabs with and
+ * without colouring for objects of thread, vma and ramfs_page caches.
+ * Used to generate /proc/slabbench.
+ **/
+void slab_bench_show(struct file *file);
+
+
+#define SLAB_DEFAULT_ALIGN	8
+
+/**
+ * Cache flags select the per-CPU layer: magazines by default, nothing at
+ * all, or the lockless CPU slab. CPUs without cmpxchg16b get magazines.
+ **/
+#define SLAB_NOMAGAZINE	(1u << 0)
+#define SLAB_LOCKLESS	(1u << 1)
+
+/* name is used only for statistics and must outlive the cache. */
+void __slab_cache_setup(struct slab_cache *cache, const char *name,
+			size_t size, size_t align, void (*ctor)(void *),
+			void (*dtor)(void *), unsigned flags);
+void slab_cache_setup(struct slab_cache *cache, const char *name,
+			size_t size);
 void slab_cache_release(struct slab_cache *cache);
 
-void slab_cache_shrink(struct slab_cache *cache);
+/* Frees all empty slabs, returns number of pages freed. */
+size_t slab_cache_shrink(struct slab_cache *cache);
 void *slab_cache_alloc(struct slab_cache *cache);
 void slab_cache_free(struct slab_cache *cache, void *ptr);
 
+/**
+ * Bulk versions take the cache lock only once and take objects from one
+ * slab while it has any. slab_cache_alloc_bulk returns number of objects
+ * actually allocated, which might be less than count.
+ **/
+size_t slab_cache_alloc_bulk(struct slab_cache *cache, size_t count,
+			void **ptrs);
+void slab_cache_free_bulk(struct slab_cache *cache, size_t count,
+			void **ptrs);
+
 #endif /*__SLAB_H__*/
@@ -24,7 +24,7 @@ struct thread {
 	struct list_head ll;
 	struct spinlock lock;
 	struct condition cv;
-	uintptr_t stack_phys;
+	void *stack;
 	int stack_order;
 	enum thread_state state;
 	struct frame *regs;
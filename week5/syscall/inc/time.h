@@ -1,7 +1,39 @@
 #ifndef __TIME_H__
 #define __TIME_H__
 
+#include <stdint.h>
+
+#include <list.h>
+
 
 void time_setup(void);
 
+/**
+ * Periodic timers: fn is called every period timer ticks from the timer
+ * interrupt handler, so it must not sleep or take locks that might be held
+ * with interrupts enabled. Usually it just wakes up a thread doing the
+ * actual work.
+ **/
+struct timer {
+	struct list_head ll;
+	unsigned long period;
+	unsigned long expires;
+	void (*fn)(struct timer *timer);
+};
+
+void timer_add(struct timer *timer);
+void timer_del(struct timer *timer);
+
+/* Number of timer ticks since time_setup. */
+unsigned long time_ticks(void);
+
+/* CPU time stamp counter, good enough to measure how long things take. */
+static inline uint64_t rdtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
 #endif /*__TIME_H__*/
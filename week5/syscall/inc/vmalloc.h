@@ -0,0 +1,23 @@
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+#include <stddef.h>
+
+
+/**
+ * vmalloc gives out virtually contiguous memory in the kernel half (see
+ * VMALLOC_BASE) backed by single pages, so large allocations don't need
+ * large physically contiguous blocks. Every area is followed by a guard
+ * page that is never mapped, so overruns (e.g. of a thread stack placed
+ * right after) fault instead of silently corrupting a neighbour.
+ *
+ * vmalloc might sleep, returns 0 if there is not enough memory or
+ * address space. vfree accepts only pointers returned by vmalloc or 0.
+ **/
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+
+/* Must be called after slab_setup and before any address space is made. */
+void vmalloc_setup(void);
+
+#endif /*__VMALLOC_H__*/
@@ -1,4 +1,5 @@
 #include <balloc.h>
+#include <buddy.h>
 
 #include <misc.h>
 #include <multiboot.h>
@@ -9,24 +10,51 @@
 
 /**
  * Bootstrap allocator uses super straightforward approach
- * - it just stores all free ranges in the array of fixed
- * size. If for some reason the arrays size is not enough
- * just report an error and hang.
+ * - it just stores all free ranges in sorted arrays. Initially
+ * arrays live inside the kernel image, when an array fills up
+ * we move it to a twice larger place taken from the free memory
+ * itself. We can't do that before we know what memory is free,
+ * but the memory map alone is never that large.
  **/
-#define BALLOC_MAX_RANGE_SIZE	256
+#define BALLOC_INIT_RANGES	256
 struct balloc_ranges {
-	struct balloc_range range[BALLOC_MAX_RANGE_SIZE];
+	struct balloc_range *range;
 	size_t size;
+	size_t capacity;
 };
-static struct balloc_ranges free, all;
+static struct balloc_range free_init[BALLOC_INIT_RANGES];
+static struct balloc_range all_init[BALLOC_INIT_RANGES];
+static struct balloc_ranges free = {free_init, 0, BALLOC_INIT_RANGES};
+static struct balloc_ranges all = {all_init, 0, BALLOC_INIT_RANGES};
+static int balloc_ready;
+
+/**
+ * CMA region takes BALLOC_CMA_SIZE, but not more than 1/BALLOC_CMA_RATIO
+ * of free memory. It consists of whole pageblocks and we prefer to put
+ * it below 4GB, since contiguous buffers are mostly needed for devices.
+ **/
+#define BALLOC_CMA_SIZE		((uintptr_t)32 << 20)
+#define BALLOC_CMA_RATIO	16
+#define BALLOC_CMA_ALIGN	((uintptr_t)PAGE_SIZE << PAGEBLOCK_ORDER)
+static struct balloc_range cma;
+
 
 
+static void balloc_grow(struct balloc_ranges *rs);
 
 static void balloc_add_range(struct balloc_ranges *rs,
 			uintptr_t begin, uintptr_t end)
 {
 	size_t from = 0, to;
 
+	/**
+	 * We add at most one range, so make sure there is space for it
+	 * before we look for the place, growing changes free ranges. Adding
+	 * back parts of removed ranges never grows, see balloc_remove_range.
+	 **/
+	if (rs->size == rs->capacity)
+		balloc_grow(rs);
+
 	while (from != rs->size && begin > rs->range[from].end)
 		++from;
 
@@ -37,16 +65,8 @@ static void balloc_add_range(struct balloc_ranges *rs,
 	/**
 	 * Now from and to semi-closed maybe closed interval of
 	 * ranges we need to replace with new one (from inclusive
-	 * and to exclusive). So we can check wether there is
-	 * enough space in the array of free ranges and report
-	 * an error if there is no enough space.
+	 * and to exclusive).
 	 **/
-	if (rs->size + 1 - (to - from) > BALLOC_MAX_RANGE_SIZE) {
-		printf("There is no enought space,"
-			" increase BALLOC_MAX_RANGE_SIZE\n");
-		while (1);
-	}
-
 	if (from != to) {
 		if (begin > rs->range[from].begin)
 			begin = rs->range[from].begin;
@@ -66,6 +86,11 @@ static void balloc_add_range(struct balloc_ranges *rs,
 	rs->range[from].end = end;
 }
 
+/**
+ * Removal adds at most one range as well, callers must make sure there is
+ * space for it: we must not grow here, since growing might take memory we
+ * are removing.
+ **/
 static void balloc_remove_range(struct balloc_ranges *rs,
 			uintptr_t begin, uintptr_t end)
 {
@@ -122,9 +147,49 @@ static uintptr_t balloc_find_range(const struct balloc_ranges *rs,
 }
 
 
+/**
+ * Moves ranges to a twice larger array. The array must have a logical
+ * address before paging_setup, so we take memory mapped by bootstrap.S.
+ **/
+static void balloc_grow(struct balloc_ranges *rs)
+{
+	/* Taking memory for the array changes free ranges as well. */
+	if (rs != &free && free.size == free.capacity)
+		balloc_grow(&free);
+
+	const size_t capacity = rs->capacity * 2;
+	const size_t size = capacity * sizeof(struct balloc_range);
+	const uintptr_t to = BOOTSTRAP_MAP_SIZE - size - PAGE_SIZE;
+
+	if (!balloc_ready) {
+		printf("There is no enought space,"
+			" increase BALLOC_INIT_RANGES\n");
+		while (1);
+	}
+
+	const uintptr_t addr = balloc_find_range(&free, 0, to, size,
+				PAGE_SIZE);
+
+	if (addr == to) {
+		printf("Failed to grow memory ranges\n");
+		while (1);
+	}
+
+	struct balloc_range *range = va(addr);
+
+	memcpy(range, rs->range, rs->size * sizeof(*range));
+	rs->range = range;
+	rs->capacity = capacity;
+	balloc_remove_range(&free, addr, addr + size);
+}
+
+
 uintptr_t __balloc_alloc(uintptr_t from, uintptr_t to,
 			size_t size, size_t align)
 {
+	if (free.size == free.capacity)
+		balloc_grow(&free);
+
 	const uintptr_t addr = balloc_find_range(&free, from, to, size, align);
 
 	if (addr == to)
@@ -139,6 +204,38 @@ uintptr_t balloc_alloc(size_t size, size_t align)
 	return __balloc_alloc(0, UINTPTR_MAX, size, align);
 }
 
+static void balloc_cma_setup(void)
+{
+	uintptr_t size = 0;
+
+	for (size_t i = 0; i != free.size; ++i)
+		size += free.range[i].end - free.range[i].begin;
+
+	size /= BALLOC_CMA_RATIO;
+	if (size > BALLOC_CMA_SIZE)
+		size = BALLOC_CMA_SIZE;
+	size = balloc_align_down(size, BALLOC_CMA_ALIGN);
+	if (!size)
+		return;
+
+	uintptr_t addr = __balloc_alloc(0, BUDDY_DMA32_LIMIT, size,
+				BALLOC_CMA_ALIGN);
+
+	if (!addr)
+		addr = balloc_alloc(size, BALLOC_CMA_ALIGN);
+	if (!addr)
+		return;
+
+	/* The region must not cross zones, so cut off what's above 4GB. */
+	if (addr < BUDDY_DMA32_LIMIT && addr + size > BUDDY_DMA32_LIMIT) {
+		balloc_add_range(&free, BUDDY_DMA32_LIMIT, addr + size);
+		size = BUDDY_DMA32_LIMIT - addr;
+	}
+
+	cma.begin = addr;
+	cma.end = addr + size;
+}
+
 void balloc_setup(void)
 {
 	const uintptr_t begin = mmap_begin;
@@ -194,12 +291,21 @@ void balloc_setup(void)
 	balloc_add_range(&all, 0, 1024 * 1024);
 	balloc_remove_range(&free, 0, 1024 * 1024);
 
+	/* From now on we know what memory we can use to grow arrays. */
+	balloc_ready = 1;
+
+	/* Reserve CMA region before anybody else takes memory. */
+	balloc_cma_setup();
+
 	/* Print free physical ranges as a "proof" we did everything well. */
 	printf("Free memory ranges:\n");
 	for (size_t i = 0; i != free.size; ++i)
 		printf("range: 0x%llx-0x%llx\n",
 				(unsigned long long)free.range[i].begin,
 				(unsigned long long)free.range[i].end);
+	printf("CMA range: 0x%llx-0x%llx\n",
+				(unsigned long long)cma.begin,
+				(unsigned long long)cma.end);
 }
 
 size_t balloc_ranges(void)
@@ -218,3 +324,7 @@ void balloc_get_free_range(size_t i, struct balloc_range *range)
 
 uintptr_t balloc_phys_mem(void)
 { return all.range[all.size - 1].end; }
+
+
+void balloc_cma_range(struct balloc_range *range)
+{ *range = cma; }
@@ -1,7 +1,16 @@
 #include <buddy.h>
 #include <balloc.h>
+#include <compact.h>
+#include <ints.h>
+#include <paging.h>
+#include <percpu.h>
 #include <print.h>
+#include <ramfs.h>
+#include <reclaim.h>
 #include <lock.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
 
 #include <stdint.h>
 #include <stddef.h>
@@ -9,11 +18,61 @@
 
 #define PAGE_FREE_MASK	0x1ul
 
+/**
+ * Migrate type of a pageblock is kept in the flags of the first page
+ * of the pageblock (see pageblock_page), besides that every free block
+ * remembers type of the free list it's on.
+ **/
+#define PAGE_BLOCK_SHIFT	1
+#define PAGE_LIST_SHIFT		4
+#define PAGE_TYPE_MASK		0x7ul
+
+/**
+ * Set in the first page of a pageblock compaction failed to free, so we
+ * don't try it again until something is freed there.
+ **/
+#define PAGE_SKIP_MASK		0x80ul
+
+/* Order of a free block. */
+#define PAGE_ORDER_SHIFT	8
+#define PAGE_ORDER_MASK		0x3ful
+
+/**
+ * Higher bits of the page flags hold index of the zone the page belongs
+ * to, so we can find the zone without looking through all of them.
+ **/
+#define PAGE_ZONE_SHIFT	48
+
+#define PAGEBLOCK_PAGES	((uintptr_t)1 << PAGEBLOCK_ORDER)
+
+
+/**
+ * Links of a page on a list are 32-bit offsets from the begin of the zone
+ * the linked page belongs to (PFN_NONE at both ends of the list), and
+ * indexes of these zones are kept in the flags, so a list (e.g. a per-CPU
+ * one) might hold pages of different zones. Unlike struct list_head a page
+ * doesn't know the list it's on, so the list must be given to remove the
+ * page.
+ **/
+#define PFN_NONE	0xffffffffu
+#define PAGE_NEXT_SHIFT	16
+#define PAGE_PREV_SHIFT	32
+#define PAGE_LINK_MASK	0xfffful
+
+struct page_list {
+	struct page *first;
+	struct page *last;
+};
+
 
 /**
  * Every zone is a buddy allocator responsible for contigous range
  * of the physical memory. We link all zones together in a linked
  * list.
+ *
+ * Free blocks of every migrate type are kept in separate lists, so
+ * allocations of different mobility take memory from different
+ * pageblocks when possible.
  **/
 struct zone {
 	struct list_head ll;
@@ -23,19 +82,42 @@ struct zone {
 	uintptr_t begin;
 	uintptr_t end;
 
-	struct list_head order[MAX_ORDER + 1];
-	struct page page[1];
+	/* only descriptors of [begin; init_end) are initialized so far */
+	uintptr_t init_end;
+	unsigned long id;
+	enum zone_type type;
+
+	/* free pages not counting isolated pageblocks, see zone_free_pages */
+	unsigned long free_pages;
+	unsigned long watermark[WMARK_COUNT];
+	/* pages unconstrained allocations leave in lower zones on top of min */
+	unsigned long lowmem_reserve;
+
+	/* bit i is set iff free[type][i] list is not empty */
+	unsigned long free_mask[MIGRATE_TYPES];
+	struct page_list free[MIGRATE_TYPES][MAX_ORDER + 1];
+
+	/* statistics, see buddy_show */
+	struct zone_stats {
+		unsigned long free;	/* free blocks */
+		unsigned long splits;	/* blocks split in halves */
+		unsigned long merges;	/* pairs of buddies united */
+		/* blocks taken from and returned to the zone */
+		struct percpu_counter allocs;
+		struct percpu_counter frees;
+	} stats[MAX_ORDER + 1];
 };
 
 
 static int page_order(const struct page *page)
 {
-	return page->order;
+	return (page->flags >> PAGE_ORDER_SHIFT) & PAGE_ORDER_MASK;
 }
 
 static void page_set_order(struct page *page, int order)
 {
-	page->order = order;
+	page->flags &= ~(PAGE_ORDER_MASK << PAGE_ORDER_SHIFT);
+	page->flags |= (unsigned long)order << PAGE_ORDER_SHIFT;
 }
 
 static int page_free(const struct page *page)
@@ -53,292 +135,2205 @@ static void page_set_busy(struct page *page)
 	page->flags &= ~PAGE_FREE_MASK;
 }
 
-
-static struct list_head buddy_zones;
-
-
-static void buddy_zone_create(uintptr_t begin, uintptr_t end)
+static int page_get_type(const struct page *page, int shift)
 {
-	if (begin >= end)
-		return;
+	return (page->flags >> shift) & PAGE_TYPE_MASK;
+}
 
-	const uintptr_t pages = (end - begin) / PAGE_SIZE;
-	const size_t size = sizeof(struct zone) +
-				sizeof(struct page) * (pages - 1);
-	const uintptr_t phys = balloc_alloc(size, PAGE_SIZE);
+static void page_set_type(struct page *page, int shift, int type)
+{
+	page->flags &= ~(PAGE_TYPE_MASK << shift);
+	page->flags |= (unsigned long)type << shift;
+}
 
-	if (!phys) {
-		printf("Failed to allocate zone\n");
-		while (1);
-	}
 
-	struct zone *zone = va(phys);
+static struct list_head buddy_zones;
+static struct zone **buddy_zone;
+static size_t buddy_zone_count;
 
-	spin_setup(&zone->lock);
-	zone->begin = begin / PAGE_SIZE;
-	zone->end = end / PAGE_SIZE;
-	for (int i = 0; i <= MAX_ORDER; ++i)
-		list_init(&zone->order[i]);
-	list_add_tail(&zone->ll, &buddy_zones);
+static unsigned long page_zone_id(const struct page *page)
+{
+	return page->flags >> PAGE_ZONE_SHIFT;
 }
 
-static struct zone *buddy_find_zone(uintptr_t phys)
+static struct page *page_link(const struct page *page, uint32_t offs,
+			int shift)
 {
-	struct list_head *head = &buddy_zones;
-
-	phys /= PAGE_SIZE;
-	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct zone *zone = (struct zone *)ptr;
+	const unsigned long id = (page->flags >> shift) & PAGE_LINK_MASK;
 
-		if (zone->begin <= phys && zone->end > phys)
-			return zone;
-	}
-	return 0;
+	return offs == PFN_NONE ? 0 : &memmap[buddy_zone[id]->begin + offs];
 }
 
-static struct zone *page_zone(const struct page *page)
+static uint32_t page_set_link(struct page *page, const struct page *to,
+			int shift)
 {
-	struct list_head *head = &buddy_zones;
+	page->flags &= ~(PAGE_LINK_MASK << shift);
+	if (!to)
+		return PFN_NONE;
 
-	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct zone *zone = (struct zone *)ptr;
-		const size_t pages = zone->end - zone->begin;
+	const unsigned long id = page_zone_id(to);
 
-		if (page >= zone->page && page < &zone->page[pages])
-			return zone;
-	}
-	return 0;
+	page->flags |= id << shift;
+	return (uint32_t)(to - memmap - buddy_zone[id]->begin);
 }
 
-static void buddy_zone_free(uintptr_t begin, uintptr_t end)
+static struct page *page_list_next(const struct page *page)
 {
-	if (begin >= end)
-		return;
+	return page_link(page, page->next, PAGE_NEXT_SHIFT);
+}
 
-	struct zone *zone = buddy_find_zone(begin);
+static struct page *page_list_prev(const struct page *page)
+{
+	return page_link(page, page->prev, PAGE_PREV_SHIFT);
+}
 
-	if (!zone || zone->end < end / PAGE_SIZE) {
-		printf("There is no zone including free range 0x%llx-0x%llx\n",
-					(unsigned long long)begin,
-					(unsigned long long)end);
-		while (1);
-	}
+static void page_list_set_next(struct page *page, const struct page *next)
+{
+	page->next = page_set_link(page, next, PAGE_NEXT_SHIFT);
+}
 
-	begin /= PAGE_SIZE;
-	end /= PAGE_SIZE;
+static void page_list_set_prev(struct page *page, const struct page *prev)
+{
+	page->prev = page_set_link(page, prev, PAGE_PREV_SHIFT);
+}
 
-	/**
-	 * Since range not neccessary consists of 2^i pages this might
-	 * look a bit complicated.
-	 **/
-	for (uintptr_t page = begin; page != end;) {
-		int order;
+static void page_list_init(struct page_list *list)
+{
+	list->first = 0;
+	list->last = 0;
+}
 
-		for (order = 0; order < MAX_ORDER; ++order) {
-			/* page is not aligned */
-			if (page & (1ull << order))
-				break;
-			/* range is too large */
-			if (page + (1ull << (order + 1)) > end)
-				break;
-		}
+static int page_list_empty(const struct page_list *list)
+{
+	return !list->first;
+}
 
-		const size_t pages = (size_t)1 << order;
-		struct page *ptr = &zone->page[page - zone->begin];
+static struct page *page_list_first(const struct page_list *list)
+{
+	return list->first;
+}
 
-		page_set_order(ptr, order);
-		page_set_free(ptr);
-		list_add_tail(&ptr->ll, &zone->order[order]);
-		page += pages;
-	}
+static struct page *page_list_last(const struct page_list *list)
+{
+	return list->last;
 }
 
-void buddy_setup(void)
+static void page_list_add(struct page_list *list, struct page *page)
 {
-	const uintptr_t mask = ~(uintptr_t)PAGE_MASK;
+	page_list_set_prev(page, 0);
+	page_list_set_next(page, list->first);
+	if (list->first)
+		page_list_set_prev(list->first, page);
+	else
+		list->last = page;
+	list->first = page;
+}
 
-	list_init(&buddy_zones);
+static void page_list_add_tail(struct page_list *list, struct page *page)
+{
+	page_list_set_next(page, 0);
+	page_list_set_prev(page, list->last);
+	if (list->last)
+		page_list_set_next(list->last, page);
+	else
+		list->first = page;
+	list->last = page;
+}
 
-	/* For every known physical memory range create it's own zone. */
-	const size_t ranges = balloc_ranges();
-	for (size_t i = 0; i != ranges; ++i) {
-		struct balloc_range range;
+static void page_list_del(struct page_list *list, struct page *page)
+{
+	struct page *prev = page_list_prev(page);
+	struct page *next = page_list_next(page);
+
+	if (prev)
+		page_list_set_next(prev, next);
+	else
+		list->first = next;
+
+	if (next)
+		page_list_set_prev(next, prev);
+	else
+		list->last = prev;
+}
 
-		balloc_get_range(i, &range);
 
-		/**
-		 * Buddy allocator works only with the whole pages, so align
-		 * the range begining and ending on PAGE_SIZE border.
-		 **/
-		const uintptr_t begin = (range.begin + PAGE_SIZE - 1) & mask;
-		const uintptr_t end = range.end & mask;
+/* Blocks never get larger than the largest zone, see buddy_max_order. */
+static int buddy_top_order;
 
-		buddy_zone_create(begin, end);
-	}
+/* Zones of every type end here, memory above is not in the direct map. */
+static const uintptr_t zone_type_end[ZONE_TYPES] = {
+	[ZONE_DMA32] = BUDDY_DMA32_LIMIT,
+	[ZONE_NORMAL] = DIRECT_MAP_SIZE,
+};
 
-	/**
-	 * All zones are initially empty (contains no free pages), so
-	 * the next step is to go over all free ranges and actually free them.
-	 **/
-	const size_t free_ranges = balloc_free_ranges();
-	for (size_t i = 0; i != free_ranges; ++i) {
-		struct balloc_range range;
+/**
+ * Page lists link pages by 32-bit offsets from the zone begin, so larger
+ * ranges are split into zones at multiples of ZONE_WINDOW and every zone
+ * leaves out the last page of the window (its offset is PFN_NONE).
+ **/
+#define ZONE_WINDOW	((uintptr_t)1 << (32 + PAGE_BITS))
 
-		balloc_get_free_range(i, &range);
+static const char *const zone_type_name[ZONE_TYPES] = {
+	[ZONE_DMA32] = "DMA32",
+	[ZONE_NORMAL] = "Normal",
+};
 
-		const uintptr_t begin = (range.begin + PAGE_SIZE - 1) & mask;
-		const uintptr_t end = range.end & mask;
+/**
+ * Initialization of all page descriptors takes time proportional to the
+ * memory size, so during boot we initialize only BUDDY_BOOT_PAGES. The
+ * rest is initialized in BUDDY_INIT_SECTION sections by a background
+ * thread (see buddy_init_late), or in BUDDY_INIT_CHUNK chunks when an
+ * allocation fails before the thread is done.
+ **/
+#define BUDDY_BOOT_PAGES	((uintptr_t)1 << 15)	/* 128MB */
+#define BUDDY_INIT_CHUNK	PAGEBLOCK_PAGES		/* 2MB */
+#define BUDDY_INIT_SECTION	((uintptr_t)1 << 18)	/* 1GB */
 
-		buddy_zone_free(begin, end);
-	}
-}
+static uintptr_t buddy_uninit_pages;
 
+/**
+ * Page indexes of the CMA region reserved by the bootstrap allocator (see
+ * balloc_cma_range), empty if there is none. Free blocks never cross the
+ * region border, so nothing but movable pages can end up inside.
+ **/
+static uintptr_t buddy_cma_begin;
+static uintptr_t buddy_cma_end;
 
-/* Main buddy allocator alloc routine. */
-static struct page *__buddy_alloc_zone(struct zone *zone, int order)
-{
-	int current = order;
+/**
+ * Bit i of buddy_free_mask[type] is set iff at least one zone has a free
+ * block of order i and given migrate type (buddy_order_zones[type][i]
+ * counts such zones). Both are updated under a zone lock with interrupts
+ * disabled, since we have only one CPU that's enough to keep them
+ * consistent.
+ **/
+static unsigned long buddy_free_mask[MIGRATE_TYPES];
+static int buddy_order_zones[MIGRATE_TYPES][MAX_ORDER + 1];
 
-	while (current <= MAX_ORDER && list_empty(&zone->order[current]))
-		++current;
+/**
+ * Number of free pages and free pageblocks (inside free blocks of
+ * PAGEBLOCK_ORDER or more) in zones not counting isolated ones.
+ **/
+static size_t buddy_free_pages;
+static size_t buddy_free_pageblocks;
 
-	if (current > MAX_ORDER)
-		return 0;
+/**
+ * Allocations we failed to satisfy. We don't know which zone is to blame
+ * for a failure, so unlike other statistics we count them globally.
+ **/
+static unsigned long buddy_failures[MAX_ORDER + 1];
 
-	struct page *page = (struct page *)(zone->order[current].next);
-	const uintptr_t idx = zone->begin + (page - zone->page);
+/**
+ * When there are no free blocks of the requested type we steal them from
+ * other types in this order. Pages for page tables, slabs and stacks stay
+ * forever, so they better take reclaimable pageblocks than movable ones.
+ **/
+static const int migrate_fallback[MIGRATE_PCPTYPES][MIGRATE_PCPTYPES - 1] = {
+	[MIGRATE_UNMOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},
+	[MIGRATE_MOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE},
+	[MIGRATE_RECLAIMABLE] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
+};
 
-	page_set_busy(page);
-	list_del(&page->ll);
 
-	while (current != order) {
-		/* Find index of the buddy descriptor. */
-		const uintptr_t bidx = idx ^ (1ull << --current);
-		struct page *buddy = zone->page + (bidx - zone->begin);
+static int flags_migrate_type(unsigned flags)
+{
+	if (flags & BUDDY_MOVABLE)
+		return MIGRATE_MOVABLE;
+	if (flags & BUDDY_RECLAIMABLE)
+		return MIGRATE_RECLAIMABLE;
+	return MIGRATE_UNMOVABLE;
+}
 
-		/* Split block in halfs and return buddy to the allocator. */
-		page_set_order(buddy, current);
-		page_set_free(buddy);
-		list_add(&buddy->ll, &zone->order[current]);
-	}
+/* Returns the lowest order >= order with free blocks in mask or -1. */
+static int free_mask_order(unsigned long mask, int order)
+{
+	mask &= ~((1ul << order) - 1);
+	return mask ? __builtin_ctzl(mask) : -1;
+}
 
-	return page;
+/**
+ * Movable allocations can also borrow pages of the CMA region, but only
+ * single pages: larger blocks are mapped as large pages, which are never
+ * moved (see pt_migrate), so cma_alloc couldn't take them back.
+ **/
+static int cma_allowed(int order, int type)
+{
+	return type == MIGRATE_MOVABLE && !order;
 }
 
-static struct page *buddy_alloc_zone(struct zone *zone, int order)
+static unsigned long zone_type_free_mask(const struct zone *zone, int order,
+			int type)
 {
-	const int enabled = spin_lock_int_save(&zone->lock);
-	struct page *page = __buddy_alloc_zone(zone, order);
+	if (cma_allowed(order, type))
+		return zone->free_mask[type] | zone->free_mask[MIGRATE_CMA];
+	return zone->free_mask[type];
+}
 
-	spin_unlock_int_restore(&zone->lock, enabled);
-	return page;
+static unsigned long buddy_type_free_mask(int order, int type)
+{
+	if (cma_allowed(order, type))
+		return buddy_free_mask[type] | buddy_free_mask[MIGRATE_CMA];
+	return buddy_free_mask[type];
 }
 
+static unsigned long zone_free_mask(const struct zone *zone)
+{
+	unsigned long mask = 0;
 
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type)
+		mask |= zone->free_mask[type];
+	return mask;
+}
 
-/* Main buddy allocator free routine. */
-static void __buddy_free_zone(struct zone *zone, struct page *page, int order)
+static unsigned long buddy_zones_free_mask(void)
 {
-	uintptr_t idx = zone->begin + (page - zone->page);
+	unsigned long mask = 0;
 
-	while (order < MAX_ORDER) {
-		/* Find buddy index and check it's exists and free. */
-		const uintptr_t bidx = idx ^ (1ull << order);
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type)
+		mask |= buddy_free_mask[type];
+	return mask;
+}
 
-		if (bidx < zone->begin || bidx >= zone->end)
-			break;
+static void buddy_count_free(struct zone *zone, int order, int type, int add)
+{
+	const size_t pages = (size_t)1 << order;
+	/* CMA pageblocks are of no use for anything but movable pages. */
+	const size_t blocks = type == MIGRATE_CMA
+				? 0 : pages >> PAGEBLOCK_ORDER;
 
-		struct page *buddy = &zone->page[bidx - zone->begin];
+	if (type == MIGRATE_ISOLATE)
+		return;
 
-		if (!page_free(buddy) || page_order(buddy) != order)
-			break;
+	if (add) {
+		zone->free_pages += pages;
+		buddy_free_pages += pages;
+		buddy_free_pageblocks += blocks;
+	} else {
+		zone->free_pages -= pages;
+		buddy_free_pages -= pages;
+		buddy_free_pageblocks -= blocks;
+	}
+}
 
-		/* Buddy is free, remove it from the list and unite halfs. */
-		list_del(&buddy->ll);
-		++order;
+static void zone_add_free(struct zone *zone, struct page *page, int order,
+			int type)
+{
+	struct page_list *list = &zone->free[type][order];
 
-		/**
-		 * If the buddy was to the left of the page it becomes a
-		 * representative of a new united block
-		 **/
-		if (bidx < idx) {
-			page = buddy;
-			idx = bidx;
-		}
+	buddy_count_free(zone, order, type, 1);
+	++zone->stats[order].free;
+
+	if (page_list_empty(list)) {
+		zone->free_mask[type] |= 1ul << order;
+		if (!buddy_order_zones[type][order]++)
+			buddy_free_mask[type] |= 1ul << order;
 	}
 
-	/* Finally return united block of pages to the allocator. */
 	page_set_order(page, order);
+	page_set_type(page, PAGE_LIST_SHIFT, type);
 	page_set_free(page);
-	list_add(&page->ll, &zone->order[order]);
+	page_list_add(list, page);
 }
 
-static void buddy_free_zone(struct zone *zone, struct page *page, int order)
+static void zone_del_free(struct zone *zone, struct page *page, int order)
 {
-	const int enabled = spin_lock_int_save(&zone->lock);
+	const int type = page_get_type(page, PAGE_LIST_SHIFT);
+	struct page_list *list = &zone->free[type][order];
 
-	__buddy_free_zone(zone, page, order);
-	spin_unlock_int_restore(&zone->lock, enabled);
+	buddy_count_free(zone, order, type, 0);
+	--zone->stats[order].free;
+	page_set_busy(page);
+	page_list_del(list, page);
+
+	if (page_list_empty(list)) {
+		zone->free_mask[type] &= ~(1ul << order);
+		if (!--buddy_order_zones[type][order])
+			buddy_free_mask[type] &= ~(1ul << order);
+	}
 }
 
 
-struct page *__buddy_alloc(int order)
+/**
+ * Zones are not neccessary aligned on pageblock border, so the first
+ * pageblock of a zone might begin outside of the zone. In this case the
+ * type is stored in the first page of the zone.
+ **/
+static struct page *pageblock_page(const struct zone *zone, uintptr_t idx)
 {
-	struct list_head *head = &buddy_zones;
+	const uintptr_t first = idx & ~(PAGEBLOCK_PAGES - 1);
 
-	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct zone *zone = (struct zone *)ptr;
-		struct page *page = buddy_alloc_zone(zone, order);
+	return &memmap[first < zone->begin ? zone->begin : first];
+}
 
-		if (page)
-			return page;
-	}
-	return 0;
+static int pageblock_type(const struct zone *zone, uintptr_t idx)
+{
+	return page_get_type(pageblock_page(zone, idx), PAGE_BLOCK_SHIFT);
 }
 
-uintptr_t buddy_alloc(int order)
+static void pageblock_set_type(struct zone *zone, uintptr_t idx, int type)
 {
-	struct list_head *head = &buddy_zones;
+	page_set_type(pageblock_page(zone, idx), PAGE_BLOCK_SHIFT, type);
+}
 
-	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct zone *zone = (struct zone *)ptr;
-		struct page *page = buddy_alloc_zone(zone, order);
+/**
+ * Changes type of the pageblock containing page idx and moves all free
+ * blocks inside the pageblock to the free lists of the new type.
+ **/
+static void pageblock_claim(struct zone *zone, uintptr_t idx, int type)
+{
+	uintptr_t from = idx & ~(PAGEBLOCK_PAGES - 1);
+	uintptr_t to = from + PAGEBLOCK_PAGES;
 
-		if (page)
-			return (zone->begin + (page - zone->page)) * PAGE_SIZE;
+	if (from < zone->begin)
+		from = zone->begin;
+	if (to > zone->init_end)
+		to = zone->init_end;
+
+	pageblock_set_type(zone, from, type);
+	while (from < to) {
+		struct page *page = &memmap[from];
+
+		if (!page_free(page)) {
+			++from;
+			continue;
+		}
+
+		const int order = page_order(page);
+
+		zone_del_free(zone, page, order);
+		zone_add_free(zone, page, order, type);
+		from += (uintptr_t)1 << order;
 	}
-	return 0;
 }
 
-void __buddy_free(struct page *page, int order)
-{
-	struct zone *zone = page_zone(page);
 
-	buddy_free_zone(zone, page, order);
+static struct zone *page_zone(const struct page *page)
+{
+	return buddy_zone[page_zone_id(page)];
 }
 
-void buddy_free(uintptr_t phys, int order)
+static int page_migrate_type(const struct page *page)
 {
-	const uintptr_t idx = phys / PAGE_SIZE;
-	struct zone *zone = buddy_find_zone(phys);
-	struct page *page = zone->page + (idx - zone->begin);
+	return pageblock_type(page_zone(page), page - memmap);
+}
 
-	buddy_free_zone(zone, page, order);
+static int buddy_cma_page(uintptr_t idx)
+{
+	return idx >= buddy_cma_begin && idx < buddy_cma_end;
 }
 
 
-uintptr_t page_addr(const struct page *page)
+#define MEMMAP_LARGE_SIZE	((uintptr_t)16 << 20)
+
+/**
+ * Maps part of the memmap describing page frames [begin; end). Since
+ * zones are not page aligned the first and the last pages of the part
+ * might be already mapped for a neighbouring zone, everything between
+ * them is always new.
+ **/
+static void buddy_memmap_map(uintptr_t begin, uintptr_t end)
+{
+	const uintptr_t mask = ~(uintptr_t)PAGE_MASK;
+	const pte_t *pml4 = va(initial_cr3);
+
+	uintptr_t from = (uintptr_t)&memmap[begin] & mask;
+	uintptr_t to = ((uintptr_t)&memmap[end] + PAGE_SIZE - 1) & mask;
+
+	if (from != to && pt_addr(pml4, from))
+		from += PAGE_SIZE;
+	if (from != to && pt_addr(pml4, to - PAGE_SIZE))
+		to -= PAGE_SIZE;
+	if (from == to)
+		return;
+
+	/**
+	 * Large memmap is worth mapping with 2MB pages (see pt_map_early),
+	 * for that physical memory must have the same offset from 2MB border
+	 * as the virtual address.
+	 **/
+	const uintptr_t large = (uintptr_t)1 << (PAGE_BITS + PAGEBLOCK_ORDER);
+	const uintptr_t offs = from & (large - 1);
+	uintptr_t phys = 0;
+
+	if (to - from >= MEMMAP_LARGE_SIZE)
+		phys = balloc_alloc(to - from + offs, large);
+
+	if (phys)
+		phys += offs;
+	else
+		phys = balloc_alloc(to - from, PAGE_SIZE);
+
+	if (!phys) {
+		printf("Failed to allocate memmap\n");
+		while (1);
+	}
+
+	pt_map_early(from, to - from, phys, PTE_WRITE);
+}
+
+static void buddy_zone_create(uintptr_t begin, uintptr_t end,
+			enum zone_type type)
 {
-	struct zone *zone = page_zone(page);
-	const uintptr_t idx = zone->begin + (page - zone->page);
+	if (begin >= end)
+		return;
+
+	const uintptr_t phys = balloc_alloc(sizeof(struct zone),
+				sizeof(struct zone *));
+
+	if (!phys) {
+		printf("Failed to allocate zone\n");
+		while (1);
+	}
+
+	struct zone *zone = va(phys);
+	const unsigned long id = buddy_zone_count++;
+
+	/* Zone index must fit into page flags, see PAGE_LINK_MASK. */
+	if (id > PAGE_LINK_MASK) {
+		printf("Too many zones\n");
+		while (1);
+	}
 
-	return idx * PAGE_SIZE;
+	spin_setup(&zone->lock);
+	zone->begin = begin / PAGE_SIZE;
+	zone->end = end / PAGE_SIZE;
+	zone->init_end = zone->begin;
+	zone->id = id;
+	zone->type = type;
+	zone->free_pages = 0;
+	zone->lowmem_reserve = 0;
+	memset(zone->stats, 0, sizeof(zone->stats));
+	for (int i = 0; i <= MAX_ORDER; ++i) {
+		struct zone_stats *stats = &zone->stats[i];
+
+		if (percpu_counter_setup(&stats->allocs, PERCPU_COUNTER_BATCH)
+				|| percpu_counter_setup(&stats->frees,
+						PERCPU_COUNTER_BATCH)) {
+			printf("Failed to allocate zone statistics\n");
+			while (1);
+		}
+	}
+	for (int mt = 0; mt != MIGRATE_TYPES; ++mt) {
+		zone->free_mask[mt] = 0;
+		for (int i = 0; i <= MAX_ORDER; ++i)
+			page_list_init(&zone->free[mt][i]);
+	}
+	list_add_tail(&zone->ll, &buddy_zones);
+	buddy_zone[id] = zone;
+	buddy_memmap_map(zone->begin, zone->end);
+	buddy_uninit_pages += zone->end - zone->begin;
 }
 
-struct page *addr_page(uintptr_t phys)
+/**
+ * Splits free block of order current taken from free lists down to order
+ * and returns halves to the allocator. Halves smaller than a pageblock go
+ * to the lists of the given type, larger ones keep their own type.
+ **/
+static void zone_split(struct zone *zone, struct page *page, int current,
+			int order, int type)
 {
-	struct zone *zone = buddy_find_zone(phys);
-	const uintptr_t idx = phys / PAGE_SIZE;
+	const uintptr_t idx = page - memmap;
+
+	while (current != order) {
+		/* Find index of the buddy descriptor. */
+		const uintptr_t bidx = idx ^ (1ull << --current);
+		struct page *buddy = &memmap[bidx];
+
+		/* Split block in halfs and return buddy to the allocator. */
+		++zone->stats[current + 1].splits;
+		zone_add_free(zone, buddy, current, current >= PAGEBLOCK_ORDER
+					? pageblock_type(zone, bidx) : type);
+	}
+}
 
-	return &zone->page[idx - zone->begin];
+/**
+ * Main buddy allocator alloc routine. Movable single pages are taken from
+ * the CMA region only when there is no other movable pages, so the region
+ * is mostly left for cma_alloc.
+ **/
+static struct page *__buddy_alloc_zone(struct zone *zone, int order, int type)
+{
+	int current = free_mask_order(zone->free_mask[type], order);
+
+	if (current < 0 && cma_allowed(order, type)) {
+		type = MIGRATE_CMA;
+		current = free_mask_order(zone->free_mask[type], order);
+	}
+
+	if (current < 0)
+		return 0;
+
+	struct page *page = page_list_first(&zone->free[type][current]);
+
+	zone_del_free(zone, page, current);
+	zone_split(zone, page, current, order, type);
+	return page;
+}
+
+/**
+ * Takes a block from free lists of other migrate types. We take the
+ * largest block available, and if it's large enough or the allocation is
+ * not movable we claim the whole pageblock, so following allocations of
+ * the same type will be satisfied from the same pageblock instead of
+ * polluting other ones.
+ **/
+static struct page *__buddy_steal_zone(struct zone *zone, int order, int type)
+{
+	for (int i = 0; i != MIGRATE_PCPTYPES - 1; ++i) {
+		const int fallback = migrate_fallback[type][i];
+		const unsigned long mask = zone->free_mask[fallback] >> order;
+
+		if (!mask)
+			continue;
+
+		const int current = order + 63 - __builtin_clzl(mask);
+		struct page *page =
+				page_list_first(&zone->free[fallback][current]);
+		const uintptr_t idx = page - memmap;
+		int list_type = type;
+
+		zone_del_free(zone, page, current);
+		if (current >= PAGEBLOCK_ORDER) {
+			/**
+			 * Halves of the block larger than a pageblock keep
+			 * their type after split (see zone_split), so claim
+			 * only pageblocks we actually allocate.
+			 **/
+			const int claim = order > PAGEBLOCK_ORDER
+						? order : PAGEBLOCK_ORDER;
+			const uintptr_t pages = (uintptr_t)1 << claim;
+
+			for (uintptr_t off = 0; off < pages;
+						off += PAGEBLOCK_PAGES)
+				pageblock_set_type(zone, idx + off, type);
+		} else if (current >= PAGEBLOCK_ORDER / 2 ||
+					type != MIGRATE_MOVABLE) {
+			pageblock_claim(zone, idx, type);
+		} else {
+			list_type = fallback;
+		}
+
+		zone_split(zone, page, current, order, list_type);
+		return page;
+	}
+	return 0;
+}
+
+
+static void zone_free_block(struct zone *zone, struct page *page, int order)
+{
+	uintptr_t idx = page - memmap;
+
+	while (order < buddy_top_order) {
+		/* Find buddy index and check it's exists and free. */
+		const uintptr_t bidx = idx ^ (1ull << order);
+
+		if (bidx < zone->begin || bidx >= zone->init_end)
+			break;
+		if (buddy_cma_page(idx) != buddy_cma_page(bidx))
+			break;
+
+		/**
+		 * Pages freed in an isolated range must stay there and free
+		 * buddies of the range must stay out, otherwise the united
+		 * block goes to the lists of the left half and either the
+		 * range loses pages or other pages get into the range.
+		 **/
+		if (order >= PAGEBLOCK_ORDER &&
+				(pageblock_type(zone, idx) == MIGRATE_ISOLATE ||
+				pageblock_type(zone, bidx) == MIGRATE_ISOLATE))
+			break;
+
+		struct page *buddy = &memmap[bidx];
+
+		if (!page_free(buddy) || page_order(buddy) != order)
+			break;
+
+		/* Buddy is free, remove it from the list and unite halfs. */
+		zone_del_free(zone, buddy, order);
+		++zone->stats[order].merges;
+		++order;
+
+		/**
+		 * If the buddy was to the left of the page it becomes a
+		 * representative of a new united block
+		 **/
+		if (bidx < idx) {
+			page = buddy;
+			idx = bidx;
+		}
+	}
+
+	/**
+	 * Finally return united block of pages to the allocator, the block
+	 * goes to the free list of the pageblock it starts in. Since there
+	 * is more free pages in the pageblock now compaction might have
+	 * more luck with it.
+	 **/
+	pageblock_page(zone, idx)->flags &= ~PAGE_SKIP_MASK;
+	zone_add_free(zone, page, order, pageblock_type(zone, idx));
+}
+
+/* Main buddy allocator free routine. */
+static void __buddy_free_zone(struct zone *zone, struct page *page, int order)
+{
+	percpu_counter_inc(&zone->stats[order].frees);
+	zone_free_block(zone, page, order);
+}
+
+static void buddy_free_zone(struct zone *zone, struct page *page, int order)
+{
+	const int enabled = spin_lock_int_save(&zone->lock);
+
+	__buddy_free_zone(zone, page, order);
+	spin_unlock_int_restore(&zone->lock, enabled);
+}
+
+
+/* Frees pages [begin; end) of the zone. */
+static void zone_free_range(struct zone *zone, uintptr_t begin, uintptr_t end)
+{
+	/**
+	 * Since range not neccessary consists of 2^i pages this might
+	 * look a bit complicated.
+	 **/
+	for (uintptr_t page = begin; page < end;) {
+		int order;
+
+		for (order = 0; order < buddy_top_order; ++order) {
+			/* page is not aligned */
+			if (page & (1ull << order))
+				break;
+			/* range is too large */
+			if (page + (1ull << (order + 1)) > end)
+				break;
+		}
+
+		const size_t pages = (size_t)1 << order;
+
+		zone_free_block(zone, &memmap[page], order);
+		page += pages;
+	}
+}
+
+/**
+ * Initializes descriptors of pages [zone->init_end; end) and gives free
+ * pages among them to the allocator. Must be called with the zone lock
+ * held. end must be pageblock aligned (or be the zone end), so that we
+ * never touch pageblocks initialized before.
+ **/
+static void zone_init_pages(struct zone *zone, uintptr_t end)
+{
+	const uintptr_t mask = ~(uintptr_t)PAGE_MASK;
+	const uintptr_t begin = zone->init_end;
+
+	/**
+	 * Initially all pageblocks are movable, kernel allocations will
+	 * claim pageblocks they need as they go.
+	 **/
+	memset(&memmap[begin], 0, (end - begin) * sizeof(struct page));
+	for (uintptr_t idx = begin; idx != end; ++idx)
+		memmap[idx].flags = (zone->id << PAGE_ZONE_SHIFT) |
+			((unsigned long)MIGRATE_MOVABLE << PAGE_BLOCK_SHIFT);
+	zone->init_end = end;
+	buddy_uninit_pages -= end - begin;
+
+	/**
+	 * Bootstrap allocator knows what memory is free, we don't need it
+	 * for anything else after setup, so we can ask it now.
+	 **/
+	const size_t ranges = balloc_free_ranges();
+
+	for (size_t i = 0; i != ranges; ++i) {
+		struct balloc_range range;
+
+		balloc_get_free_range(i, &range);
+
+		uintptr_t from = ((range.begin + PAGE_SIZE - 1) & mask) /
+					PAGE_SIZE;
+		uintptr_t to = (range.end & mask) / PAGE_SIZE;
+
+		if (from < begin)
+			from = begin;
+		if (to > end)
+			to = end;
+		if (from < to)
+			zone_free_range(zone, from, to);
+	}
+
+	/* The CMA region is not free for balloc, but it's free for us. */
+	uintptr_t from = buddy_cma_begin;
+	uintptr_t to = buddy_cma_end;
+
+	if (from < begin)
+		from = begin;
+	if (to > end)
+		to = end;
+	if (from >= to)
+		return;
+
+	for (uintptr_t idx = from; idx < to; idx += PAGEBLOCK_PAGES)
+		pageblock_set_type(zone, idx, MIGRATE_CMA);
+	zone_free_range(zone, from, to);
+}
+
+/**
+ * Initializes the next chunk of the given size (power of 2) of the first
+ * zone that still has uninitialized pages. Returns zero if all memory is
+ * initialized already.
+ **/
+static int buddy_init_chunk(uintptr_t pages)
+{
+	struct list_head *head = &buddy_zones;
+
+	if (!buddy_uninit_pages)
+		return 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		if (zone->init_end == zone->end) {
+			spin_unlock_int_restore(&zone->lock, enabled);
+			continue;
+		}
+
+		uintptr_t end = (zone->init_end & ~(pages - 1)) + pages;
+
+		if (end > zone->end)
+			end = zone->end;
+
+		zone_init_pages(zone, end);
+		spin_unlock_int_restore(&zone->lock, enabled);
+		return 1;
+	}
+	return 0;
+}
+
+/* Initializes all pages of the zone up to the page idx inclusive. */
+static void buddy_init_upto(uintptr_t idx)
+{
+	struct list_head *head = &buddy_zones;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+
+		if (idx < zone->begin || idx >= zone->end)
+			continue;
+
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		while (zone->init_end <= idx) {
+			uintptr_t end = (zone->init_end &
+					~(BUDDY_INIT_CHUNK - 1)) +
+					BUDDY_INIT_CHUNK;
+
+			if (end > zone->end)
+				end = zone->end;
+			zone_init_pages(zone, end);
+		}
+		spin_unlock_int_restore(&zone->lock, enabled);
+		return;
+	}
+}
+
+
+/**
+ * Zone lists are shared and protected by the zone lock, so to make the
+ * most common small allocations cheaper every CPU keeps a few lists of
+ * recently freed pages of small orders. Pages are moved between these
+ * lists and zones in batches: when a list is empty we take "low" pages
+ * from zones at once, and when a list grows above "high" we return pages
+ * to zones until only "low" left.
+ *
+ * Pages on these lists are busy from the point of view of zones. Every
+ * migrate type has its own lists, so pages don't change their type
+ * going through them.
+ **/
+#define PCP_MAX_ORDER	3
+
+struct pcp_list {
+	struct page_list pages;
+	int count;
+	int low;
+	int high;
+};
+
+struct pcp {
+	struct pcp_list list[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];
+};
+
+/* We support only one CPU so far, so there is only one set of lists. */
+static struct pcp buddy_pcp;
+
+
+static void pcp_setup(struct pcp *pcp)
+{
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type) {
+		for (int order = 0; order <= PCP_MAX_ORDER; ++order) {
+			struct pcp_list *list = &pcp->list[type][order];
+
+			page_list_init(&list->pages);
+			list->count = 0;
+			list->low = 32 >> order;
+			list->high = 128 >> order;
+		}
+	}
+}
+
+/**
+ * Memory we haven't initialized yet is mostly free, so we count it as
+ * free for the purpose of watermark checks, there is no point to reclaim
+ * anything if we can initialize more memory instead.
+ **/
+static unsigned long zone_free_pages(const struct zone *zone)
+{
+	return zone->free_pages + (zone->end - zone->init_end);
+}
+
+static int zone_watermark_ok(const struct zone *zone, int order, int mark,
+			unsigned long reserve)
+{
+	return zone_free_pages(zone) >= zone->watermark[mark] + reserve +
+				((unsigned long)1 << order);
+}
+
+/* Flags for the zone fill routines below. */
+#define FILL_STEAL	(1 << 0)	/* take pages of other migrate types */
+#define FILL_RESERVE	(1 << 1)	/* go below the min watermark */
+
+static size_t buddy_zone_fill(struct zone *zone, int order, int type,
+			int flags, size_t count, struct page_list *list)
+{
+	const int steal = flags & FILL_STEAL;
+	const unsigned long mask = steal ? zone_free_mask(zone)
+				: zone_type_free_mask(zone, order, type);
+
+	if (free_mask_order(mask, order) < 0)
+		return 0;
+
+	const int enabled = spin_lock_int_save(&zone->lock);
+	size_t filled = 0;
+
+	for (; filled != count; ++filled) {
+		if (!(flags & FILL_RESERVE) &&
+				!zone_watermark_ok(zone, order, WMARK_MIN,
+						zone->lowmem_reserve))
+			break;
+
+		struct page *page = __buddy_alloc_zone(zone, order, type);
+
+		if (!page && steal)
+			page = __buddy_steal_zone(zone, order, type);
+		if (!page)
+			break;
+		percpu_counter_inc(&zone->stats[order].allocs);
+		page_list_add_tail(list, page);
+	}
+	spin_unlock_int_restore(&zone->lock, enabled);
+	return filled;
+}
+
+static size_t __buddy_zones_fill(int order, int type, int flags,
+			size_t count, struct page_list *list)
+{
+	struct list_head *head = &buddy_zones;
+	const unsigned long mask = (flags & FILL_STEAL)
+				? buddy_zones_free_mask()
+				: buddy_type_free_mask(order, type);
+	size_t filled = 0;
+
+	if (free_mask_order(mask, order) < 0)
+		return 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+
+		filled += buddy_zone_fill(zone, order, type, flags,
+					count - filled, list);
+		if (filled == count)
+			break;
+	}
+	return filled;
+}
+
+/**
+ * Takes up to count blocks from zones, locking every zone only once. We
+ * steal pages of other migrate types only if no zone has enough pages of
+ * the requested type. Before stealing we initialize more memory if there
+ * is no free pageblocks, so that we rather steal a whole new pageblock
+ * than mix types in a used one.
+ *
+ * Zones are not allowed to go below the min watermark unless reserve is
+ * set, that's only for allocations that failed even after reclaim.
+ **/
+static size_t buddy_zones_fill(int order, int type, int reserve,
+			size_t count, struct page_list *list)
+{
+	const int flags = reserve ? FILL_RESERVE : 0;
+	size_t filled = __buddy_zones_fill(order, type, flags, count, list);
+
+	while (filled != count &&
+			free_mask_order(buddy_zones_free_mask(),
+					PAGEBLOCK_ORDER) < 0 &&
+			buddy_init_chunk(BUDDY_INIT_CHUNK)) {
+		filled += __buddy_zones_fill(order, type, flags,
+					count - filled, list);
+	}
+
+	if (filled != count)
+		filled += __buddy_zones_fill(order, type, flags | FILL_STEAL,
+					count - filled, list);
+	return filled;
+}
+
+/**
+ * Helper for freeing a bunch of blocks: locks the zone unless it's already
+ * locked, so a run of blocks from the same zone takes the lock only once.
+ * Call with zero zone to release the last lock.
+ **/
+static void buddy_zone_relock(struct zone **locked, int *enabled,
+			struct zone *zone)
+{
+	if (*locked == zone)
+		return;
+
+	if (*locked)
+		spin_unlock_int_restore(&(*locked)->lock, *enabled);
+	if (zone)
+		*enabled = spin_lock_int_save(&zone->lock);
+	*locked = zone;
+}
+
+/* Reserve pages are taken one at a time, not to waste them on caches. */
+static void pcp_fill(struct pcp_list *pcp, int order, int type, int reserve)
+{
+	pcp->count += buddy_zones_fill(order, type, reserve,
+				reserve ? 1 : pcp->low - pcp->count,
+				&pcp->pages);
+}
+
+/* Returns the coldest pages (from the tail of the list) back to zones. */
+static void pcp_drain(struct pcp_list *pcp, int order, int count)
+{
+	struct zone *locked = 0;
+	int enabled = 0;
+
+	for (; count && pcp->count; --count, --pcp->count) {
+		struct page *page = page_list_last(&pcp->pages);
+		struct zone *zone = page_zone(page);
+
+		page_list_del(&pcp->pages, page);
+		buddy_zone_relock(&locked, &enabled, zone);
+		__buddy_free_zone(zone, page, order);
+	}
+	buddy_zone_relock(&locked, &enabled, 0);
+}
+
+static void pcp_drain_all(struct pcp *pcp)
+{
+	const int enabled = local_int_save();
+
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type) {
+		for (int order = 0; order <= PCP_MAX_ORDER; ++order) {
+			struct pcp_list *list = &pcp->list[type][order];
+
+			pcp_drain(list, order, list->count);
+		}
+	}
+	local_int_restore(enabled);
+}
+
+static struct page *pcp_alloc(struct pcp *pcp, int order, int type,
+			int reserve)
+{
+	struct pcp_list *list = &pcp->list[type][order];
+	struct page *page = 0;
+	const int enabled = local_int_save();
+
+	if (!list->count)
+		pcp_fill(list, order, type, reserve);
+
+	if (list->count) {
+		page = page_list_first(&list->pages);
+		page_list_del(&list->pages, page);
+		--list->count;
+	}
+	local_int_restore(enabled);
+	return page;
+}
+
+static void pcp_free(struct pcp *pcp, struct page *page, int order)
+{
+	const int type = page_migrate_type(page);
+
+	/* Pages of isolated pageblocks must get to zones immediately. */
+	if (type >= MIGRATE_PCPTYPES) {
+		buddy_free_zone(page_zone(page), page, order);
+		return;
+	}
+
+	const int enabled = local_int_save();
+	struct pcp_list *list = &pcp->list[type][order];
+
+	page_list_add(&list->pages, page);
+	if (++list->count > list->high)
+		pcp_drain(list, order, list->count - list->low);
+	local_int_restore(enabled);
+}
+
+
+/**
+ * Pools of pages filled with zeroes in advance, when the CPU has nothing
+ * better to do (see buddy_zero_refill), so that BUDDY_ZERO allocations
+ * don't have to clear memory themselves. Like per-CPU lists they're
+ * protected by disabling interrupts.
+ *
+ * Zeroed pages are mostly asked for page tables (unmovable) and user
+ * memory (movable), so only these two types have pools.
+ **/
+struct zero_pool {
+	struct page_list pages;
+	int count;
+	int size;
+	struct percpu_counter hits;
+	struct percpu_counter misses;
+};
+
+static const int zero_pool_size[MIGRATE_PCPTYPES] = {
+	[MIGRATE_UNMOVABLE] = 64,
+	[MIGRATE_MOVABLE] = 192,
+	[MIGRATE_RECLAIMABLE] = 0,
+};
+
+static struct zero_pool buddy_zero_pool[MIGRATE_PCPTYPES];
+
+
+static void zero_pool_setup(struct zero_pool *pool, int size)
+{
+	page_list_init(&pool->pages);
+	pool->count = 0;
+	pool->size = size;
+	if (percpu_counter_setup(&pool->hits, PERCPU_COUNTER_BATCH) ||
+			percpu_counter_setup(&pool->misses,
+					PERCPU_COUNTER_BATCH)) {
+		printf("Failed to allocate zero pool statistics\n");
+		while (1);
+	}
+}
+
+static void page_zero(struct page *page, int order)
+{
+	void *ptr = va(page_addr(page));
+	size_t words = ((size_t)PAGE_SIZE << order) / sizeof(uint64_t);
+
+	__asm__ volatile ("rep stosq"
+		: "+D"(ptr), "+c"(words)
+		: "a"(0ull)
+		: "memory");
+}
+
+static size_t zero_pool_get(struct zero_pool *pool, size_t count,
+			struct page **pages)
+{
+	const int enabled = local_int_save();
+	size_t got = 0;
+
+	for (; got != count && pool->count; ++got, --pool->count) {
+		pages[got] = page_list_first(&pool->pages);
+		page_list_del(&pool->pages, pages[got]);
+	}
+	local_int_restore(enabled);
+	percpu_counter_add(&pool->hits, got);
+	percpu_counter_add(&pool->misses, count - got);
+	return got;
+}
+
+static void zero_pool_drain(struct zero_pool *pool)
+{
+	const int enabled = local_int_save();
+
+	while (pool->count) {
+		struct page *page = page_list_first(&pool->pages);
+
+		page_list_del(&pool->pages, page);
+		--pool->count;
+		pcp_free(&buddy_pcp, page, 0);
+	}
+	local_int_restore(enabled);
+}
+
+/* Returns all pages cached by per-CPU lists and pools back to zones. */
+static void buddy_drain_all(void)
+{
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type)
+		zero_pool_drain(&buddy_zero_pool[type]);
+	pcp_drain_all(&buddy_pcp);
+}
+
+static size_t buddy_shrink(struct shrinker *shrinker, size_t pages)
+{
+	size_t cached = 0;
+
+	(void) shrinker;
+	(void) pages;
+
+	const int enabled = local_int_save();
+
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type) {
+		cached += buddy_zero_pool[type].count;
+		for (int order = 0; order <= PCP_MAX_ORDER; ++order)
+			cached += (size_t)buddy_pcp.list[type][order].count
+						<< order;
+	}
+	buddy_drain_all();
+	local_int_restore(enabled);
+	return cached;
+}
+
+static struct shrinker buddy_shrinker = {.shrink = &buddy_shrink};
+
+
+static unsigned long isqrt(unsigned long x)
+{
+	unsigned long bit = 1ul << (sizeof(x) * 8 - 2);
+	unsigned long res = 0;
+
+	while (bit > x)
+		bit >>= 2;
+
+	for (; bit; bit >>= 2) {
+		if (x >= res + bit) {
+			x -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+	}
+	return res;
+}
+
+/**
+ * Like Linux we reserve sqrt(16 * memory size in KB) KB, but not less
+ * than 128KB and not more than 64MB, and split it between zones in
+ * proportion to their sizes. That's the min watermark, low and high
+ * watermarks are 5/4 and 3/2 of min.
+ *
+ * On top of that allocations without constraints leave in DMA32 zones
+ * 1/LOWMEM_RESERVE_RATIO of the NORMAL memory size (again split in
+ * proportion to sizes), so that they don't take all the memory only
+ * DMA32 zones can provide.
+ **/
+#define WMARK_MIN_KB_LOW	128ul
+#define WMARK_MIN_KB_HIGH	65536ul
+#define LOWMEM_RESERVE_RATIO	256ul
+
+static void buddy_watermarks_setup(void)
+{
+	struct list_head *head = &buddy_zones;
+	unsigned long type_pages[ZONE_TYPES] = {0};
+	unsigned long pages = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		const struct zone *zone = (const struct zone *)ptr;
+
+		pages += zone->end - zone->begin;
+		type_pages[zone->type] += zone->end - zone->begin;
+	}
+
+	const unsigned long reserve = type_pages[ZONE_NORMAL] /
+				LOWMEM_RESERVE_RATIO;
+
+	unsigned long min_kb = isqrt(pages * (PAGE_SIZE / 1024) * 16);
+
+	if (min_kb < WMARK_MIN_KB_LOW)
+		min_kb = WMARK_MIN_KB_LOW;
+	if (min_kb > WMARK_MIN_KB_HIGH)
+		min_kb = WMARK_MIN_KB_HIGH;
+
+	const unsigned long min = min_kb / (PAGE_SIZE / 1024);
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+		const unsigned long zone_min = pages
+			? min * (zone->end - zone->begin) / pages : 0;
+
+		zone->watermark[WMARK_MIN] = zone_min;
+		zone->watermark[WMARK_LOW] = zone_min + zone_min / 4;
+		zone->watermark[WMARK_HIGH] = zone_min + zone_min / 2;
+
+		if (zone->type == ZONE_DMA32 && type_pages[ZONE_DMA32])
+			zone->lowmem_reserve = reserve *
+						(zone->end - zone->begin) /
+						type_pages[ZONE_DMA32];
+	}
+}
+
+size_t buddy_watermark_deficit(int mark)
+{
+	struct list_head *head = &buddy_zones;
+	size_t deficit = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		const struct zone *zone = (const struct zone *)ptr;
+		const unsigned long free = zone_free_pages(zone);
+
+		if (free < zone->watermark[mark])
+			deficit += zone->watermark[mark] - free;
+	}
+	return deficit;
+}
+
+
+void buddy_setup(void)
+{
+	const uintptr_t mask = ~(uintptr_t)PAGE_MASK;
+
+	list_init(&buddy_zones);
+
+	/**
+	 * For every known physical memory range create it's own zone, or
+	 * more if the range crosses the end of DMA32 or a ZONE_WINDOW
+	 * border. Zones are tried in the order of the list, so we put NORMAL
+	 * zones first.
+	 **/
+	const size_t ranges = balloc_ranges();
+	size_t count = ZONE_TYPES * ranges;
+
+	for (size_t i = 0; i != ranges; ++i) {
+		struct balloc_range range;
+
+		balloc_get_range(i, &range);
+		count += range.end / ZONE_WINDOW - range.begin / ZONE_WINDOW;
+	}
+
+	const uintptr_t zones = balloc_alloc(count * sizeof(struct zone *),
+				sizeof(struct zone *));
+
+	if (!zones) {
+		printf("Failed to allocate zones\n");
+		while (1);
+	}
+
+	struct balloc_range cma;
+
+	balloc_cma_range(&cma);
+	buddy_cma_begin = cma.begin >> PAGE_BITS;
+	buddy_cma_end = cma.end >> PAGE_BITS;
+
+	buddy_zone = va(zones);
+	for (int type = ZONE_TYPES - 1; type >= 0; --type) {
+		const uintptr_t low = type ? zone_type_end[type - 1] : 0;
+		const uintptr_t high = zone_type_end[type];
+
+		for (size_t i = 0; i != ranges; ++i) {
+			struct balloc_range range;
+
+			balloc_get_range(i, &range);
+
+			/**
+			 * Buddy allocator works only with the whole pages, so
+			 * align the range begining and ending on PAGE_SIZE
+			 * border.
+			 **/
+			uintptr_t begin = (range.begin + PAGE_SIZE - 1) & mask;
+			uintptr_t end = range.end & mask;
+
+			if (begin < low)
+				begin = low;
+			if (end > high)
+				end = high;
+
+			while (begin < end) {
+				const uintptr_t window =
+					(begin & ~(ZONE_WINDOW - 1)) +
+					ZONE_WINDOW - PAGE_SIZE;
+				const uintptr_t zend =
+					end < window ? end : window;
+
+				buddy_zone_create(begin, zend, type);
+				begin = zend + (zend == window ? PAGE_SIZE : 0);
+			}
+		}
+	}
+
+	/* The largest block must fit into the largest zone. */
+	for (size_t i = 0; i != buddy_zone_count; ++i) {
+		const struct zone *zone = buddy_zone[i];
+		const uintptr_t pages = zone->end - zone->begin;
+
+		while (buddy_top_order < MAX_ORDER &&
+				((uintptr_t)2 << buddy_top_order) <= pages)
+			++buddy_top_order;
+	}
+
+	buddy_watermarks_setup();
+	pcp_setup(&buddy_pcp);
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type)
+		zero_pool_setup(&buddy_zero_pool[type], zero_pool_size[type]);
+	shrinker_register(&buddy_shrinker);
+
+	/**
+	 * All zones are initially empty (contains no free pages), so the
+	 * next step is to initialize page descriptors and free free pages,
+	 * but only as many as we need to boot.
+	 **/
+	for (uintptr_t boot = 0; boot < BUDDY_BOOT_PAGES;
+				boot += BUDDY_INIT_CHUNK) {
+		if (!buddy_init_chunk(BUDDY_INIT_CHUNK))
+			break;
+	}
+
+	/* cma_alloc might be called before the init thread gets there. */
+	if (buddy_cma_begin != buddy_cma_end)
+		buddy_init_upto(buddy_cma_end - 1);
+}
+
+static int buddy_init_thread(void *unused)
+{
+	(void) unused;
+
+	/**
+	 * We take the zone lock for every chunk not to keep interrupts
+	 * disabled for too long, and let others run after every section.
+	 **/
+	while (buddy_uninit_pages) {
+		for (uintptr_t done = 0; done < BUDDY_INIT_SECTION;
+					done += BUDDY_INIT_CHUNK) {
+			if (!buddy_init_chunk(BUDDY_INIT_CHUNK))
+				break;
+		}
+		schedule();
+	}
+	return 0;
+}
+
+void buddy_init_late(void)
+{
+	if (!buddy_uninit_pages)
+		return;
+
+	struct thread *thread = thread_create(&buddy_init_thread, 0);
+
+	if (!thread) {
+		printf("Failed to create memory init thread\n");
+		while (1);
+	}
+	thread_start(thread);
+}
+
+
+
+static struct page *buddy_alloc_zones(int order, int type, int reserve)
+{
+	struct page_list list;
+
+	page_list_init(&list);
+	if (!buddy_zones_fill(order, type, reserve, 1, &list))
+		return 0;
+	return page_list_first(&list);
+}
+
+static struct page *buddy_alloc_try(int order, int type, int reserve)
+{
+	if (order <= PCP_MAX_ORDER)
+		return pcp_alloc(&buddy_pcp, order, type, reserve);
+	return buddy_alloc_zones(order, type, reserve);
+}
+
+/* Number of pages to reclaim to get count pages above the min watermark. */
+static size_t buddy_reclaim_target(size_t count)
+{
+	return buddy_watermark_deficit(WMARK_MIN) + count;
+}
+
+static struct page *__buddy_alloc_pages(int order, int type)
+{
+	struct page *page = buddy_alloc_try(order, type, 0);
+
+	if (page)
+		return page;
+
+	/**
+	 * Free pages might be stuck in zero pools or in per-CPU lists of
+	 * other orders, so return them to zones and give it another try.
+	 **/
+	buddy_drain_all();
+	do {
+		page = buddy_alloc_try(order, type, 0);
+
+		/* Memory we haven't initialized yet might help as well. */
+	} while (!page && buddy_init_chunk(BUDDY_INIT_CHUNK));
+
+	/**
+	 * Otherwise we are below the min watermark, so ask caches to give
+	 * some memory back, and if it doesn't help use the reserve.
+	 **/
+	if (!page && reclaim_pages(buddy_reclaim_target((size_t)1 << order))) {
+		buddy_drain_all();
+		page = buddy_alloc_try(order, type, 0);
+	}
+
+	if (!page)
+		page = buddy_alloc_try(order, type, 1);
+	if (!page)
+		++buddy_failures[order];
+	return page;
+}
+
+static struct page *buddy_alloc_pages(int order, int type)
+{
+	struct page *page = __buddy_alloc_pages(order, type);
+
+	/**
+	 * Let compaction know if we are running out of free pageblocks and
+	 * the reclaim thread if we are running out of free memory.
+	 **/
+	compact_wakeup();
+	reclaim_wakeup();
+	return page;
+}
+
+int buddy_max_order(void)
+{
+	return buddy_top_order;
+}
+
+struct page *__buddy_alloc(int order, unsigned flags)
+{
+	const int type = flags_migrate_type(flags);
+	struct page *page;
+
+	if (order > buddy_top_order)
+		return 0;
+
+	if ((flags & BUDDY_ZERO) && !order &&
+			zero_pool_get(&buddy_zero_pool[type], 1, &page))
+		return page;
+
+	page = buddy_alloc_pages(order, type);
+	if (page && (flags & BUDDY_ZERO))
+		page_zero(page, order);
+	return page;
+}
+
+uintptr_t buddy_alloc(int order, unsigned flags)
+{
+	struct page *page = __buddy_alloc(order, flags);
+
+	return page ? page_addr(page) : 0;
+}
+
+/**
+ * Looks through free lists of the zone for a block of at least the given
+ * order that starts low enough to have the first 2^order pages below
+ * max_pfn, blocks of the requested migrate type are preferred. The block
+ * is split as usual, so we get the lowest part of it.
+ **/
+static struct page *__buddy_alloc_zone_range(struct zone *zone, int order,
+			int type, uintptr_t max_pfn)
+{
+	const uintptr_t pages = (uintptr_t)1 << order;
+
+	if (zone->begin + pages > max_pfn)
+		return 0;
+
+	for (int i = 0; i != MIGRATE_PCPTYPES; ++i) {
+		const int mt = i ? migrate_fallback[type][i - 1] : type;
+
+		for (int current = order; current <= buddy_top_order;
+					++current) {
+			struct page *page =
+				page_list_first(&zone->free[mt][current]);
+
+			while (page &&
+				(uintptr_t)(page - memmap) + pages > max_pfn)
+				page = page_list_next(page);
+
+			if (!page)
+				continue;
+
+			zone_del_free(zone, page, current);
+			zone_split(zone, page, current, order, mt);
+			return page;
+		}
+	}
+	return 0;
+}
+
+static struct page *buddy_zones_alloc_range(int order, int type,
+			uintptr_t max_pfn, int reserve)
+{
+	struct list_head *head = &buddy_zones;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+		struct page *page = 0;
+
+		if (zone->begin >= max_pfn)
+			continue;
+
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		if (reserve || zone_watermark_ok(zone, order, WMARK_MIN, 0))
+			page = __buddy_alloc_zone_range(zone, order, type,
+						max_pfn);
+		if (page)
+			percpu_counter_inc(&zone->stats[order].allocs);
+		spin_unlock_int_restore(&zone->lock, enabled);
+
+		if (page)
+			return page;
+	}
+	return 0;
+}
+
+/**
+ * Per-CPU lists and zero pools keep pages of any zone, so constrained
+ * allocations go to zones directly, otherwise it's the same sequence of
+ * steps as in __buddy_alloc_pages.
+ **/
+struct page *__buddy_alloc_range(int order, unsigned flags,
+			uintptr_t max_phys)
+{
+	const int type = flags_migrate_type(flags);
+	const uintptr_t max_pfn = max_phys >> PAGE_BITS;
+
+	if (order > buddy_top_order)
+		return 0;
+
+	struct page *page = buddy_zones_alloc_range(order, type, max_pfn, 0);
+
+	if (!page) {
+		buddy_drain_all();
+		do {
+			page = buddy_zones_alloc_range(order, type, max_pfn, 0);
+		} while (!page && buddy_init_chunk(BUDDY_INIT_CHUNK));
+	}
+
+	if (!page && reclaim_pages(buddy_reclaim_target((size_t)1 << order))) {
+		buddy_drain_all();
+		page = buddy_zones_alloc_range(order, type, max_pfn, 0);
+	}
+
+	if (!page)
+		page = buddy_zones_alloc_range(order, type, max_pfn, 1);
+
+	if (!page)
+		++buddy_failures[order];
+	else if (flags & BUDDY_ZERO)
+		page_zero(page, order);
+
+	compact_wakeup();
+	reclaim_wakeup();
+	return page;
+}
+
+uintptr_t buddy_alloc_range(int order, unsigned flags, uintptr_t max_phys)
+{
+	struct page *page = __buddy_alloc_range(order, flags, max_phys);
+
+	return page ? page_addr(page) : 0;
+}
+
+/**
+ * Versions of bulk routines working with physical addresses convert them
+ * to descriptors in batches of this size on the stack.
+ **/
+#define BUDDY_BULK_BATCH	32
+
+static size_t buddy_alloc_pages_bulk(int order, int type, size_t count,
+			struct page **pages)
+{
+	struct page_list list;
+	size_t got = 0;
+
+	if (order <= PCP_MAX_ORDER) {
+		struct pcp_list *pcp = &buddy_pcp.list[type][order];
+		const int enabled = local_int_save();
+
+		for (; got != count && pcp->count; ++got, --pcp->count) {
+			pages[got] = page_list_first(&pcp->pages);
+			page_list_del(&pcp->pages, pages[got]);
+		}
+		local_int_restore(enabled);
+	}
+
+	/**
+	 * The rest we take from zones directly bypassing per-CPU lists, if
+	 * there is not enough we go through the same steps as a single
+	 * allocation does (see __buddy_alloc_pages).
+	 **/
+	const size_t want = count - got;
+	size_t filled = 0;
+
+	page_list_init(&list);
+	if (want)
+		filled = buddy_zones_fill(order, type, 0, want, &list);
+
+	if (filled != want) {
+		buddy_drain_all();
+		do {
+			filled += buddy_zones_fill(order, type, 0,
+						want - filled, &list);
+		} while (filled != want && buddy_init_chunk(BUDDY_INIT_CHUNK));
+	}
+
+	if (filled != want && reclaim_pages(buddy_reclaim_target(
+				(want - filled) << order))) {
+		buddy_drain_all();
+		filled += buddy_zones_fill(order, type, 0, want - filled, &list);
+	}
+
+	if (filled != want)
+		filled += buddy_zones_fill(order, type, 1, want - filled, &list);
+
+	for (struct page *page = page_list_first(&list); page;
+				page = page_list_next(page))
+		pages[got++] = page;
+
+	if (got != count)
+		++buddy_failures[order];
+	compact_wakeup();
+	reclaim_wakeup();
+	return got;
+}
+
+size_t __buddy_alloc_bulk(int order, unsigned flags, size_t count,
+			struct page **pages)
+{
+	const int type = flags_migrate_type(flags);
+	size_t got = 0;
+
+	if (order > buddy_top_order)
+		return 0;
+
+	if ((flags & BUDDY_ZERO) && !order)
+		got = zero_pool_get(&buddy_zero_pool[type], count, pages);
+
+	const size_t ret = buddy_alloc_pages_bulk(order, type, count - got,
+				pages + got);
+
+	if (flags & BUDDY_ZERO) {
+		for (size_t i = got; i != got + ret; ++i)
+			page_zero(pages[i], order);
+	}
+	return got + ret;
+}
+
+size_t buddy_alloc_bulk(int order, unsigned flags, size_t count,
+			uintptr_t *phys)
+{
+	struct page *pages[BUDDY_BULK_BATCH];
+	size_t got = 0;
+
+	while (got != count) {
+		const size_t todo = count - got < BUDDY_BULK_BATCH
+					? count - got : BUDDY_BULK_BATCH;
+		const size_t ret = __buddy_alloc_bulk(order, flags, todo, pages);
+
+		for (size_t i = 0; i != ret; ++i)
+			phys[got++] = page_addr(pages[i]);
+
+		if (ret != todo)
+			break;
+	}
+	return got;
+}
+
+void __buddy_free(struct page *page, int order)
+{
+	if (order <= PCP_MAX_ORDER) {
+		pcp_free(&buddy_pcp, page, order);
+		return;
+	}
+
+	buddy_free_zone(page_zone(page), page, order);
+}
+
+void buddy_free(uintptr_t phys, int order)
+{
+	__buddy_free(addr_page(phys), order);
+}
+
+void __buddy_free_bulk(int order, size_t count, struct page **pages)
+{
+	if (order <= PCP_MAX_ORDER) {
+		const int enabled = local_int_save();
+
+		for (size_t i = 0; i != count; ++i)
+			pcp_free(&buddy_pcp, pages[i], order);
+		local_int_restore(enabled);
+		return;
+	}
+
+	struct zone *locked = 0;
+	int enabled = 0;
+
+	for (size_t i = 0; i != count; ++i) {
+		struct zone *zone = page_zone(pages[i]);
+
+		buddy_zone_relock(&locked, &enabled, zone);
+		__buddy_free_zone(zone, pages[i], order);
+	}
+	buddy_zone_relock(&locked, &enabled, 0);
+}
+
+void buddy_free_bulk(int order, size_t count, const uintptr_t *phys)
+{
+	struct page *pages[BUDDY_BULK_BATCH];
+
+	while (count) {
+		const size_t todo = count < BUDDY_BULK_BATCH
+					? count : BUDDY_BULK_BATCH;
+
+		for (size_t i = 0; i != todo; ++i)
+			pages[i] = addr_page(phys[i]);
+
+		__buddy_free_bulk(order, todo, pages);
+		phys += todo;
+		count -= todo;
+	}
+}
+
+
+int buddy_zero_refill(void)
+{
+	struct zero_pool *pool = 0;
+	int type = 0;
+
+	/* Refill the pool that lacks the most pages first. */
+	for (int i = 0; i != MIGRATE_PCPTYPES; ++i) {
+		struct zero_pool *p = &buddy_zero_pool[i];
+
+		if (!pool || p->size - p->count > pool->size - pool->count) {
+			pool = p;
+			type = i;
+		}
+	}
+
+	if (pool->count >= pool->size)
+		return 0;
+
+	/* Pages in the pool are wasted if memory is short. */
+	if (buddy_watermark_deficit(WMARK_LOW))
+		return 0;
+
+	/**
+	 * We don't want to drain per-CPU lists or the pool itself if there
+	 * is no free memory, so don't use the generic allocation path.
+	 **/
+	struct page *page = pcp_alloc(&buddy_pcp, 0, type, 0);
+
+	if (!page)
+		return 0;
+
+	page_zero(page, 0);
+
+	const int enabled = local_int_save();
+
+	page_list_add(&pool->pages, page);
+	++pool->count;
+	local_int_restore(enabled);
+	return 1;
+}
+
+void buddy_zero_stats(struct buddy_zero_stats *stats)
+{
+	const int enabled = local_int_save();
+
+	stats->pages = 0;
+	stats->hits = 0;
+	stats->misses = 0;
+	for (int type = 0; type != MIGRATE_PCPTYPES; ++type) {
+		struct zero_pool *pool = &buddy_zero_pool[type];
+
+		stats->pages += pool->count;
+		stats->hits += percpu_counter_sum(&pool->hits);
+		stats->misses += percpu_counter_sum(&pool->misses);
+	}
+	local_int_restore(enabled);
+}
+
+
+/* Returns number of free pages in the pageblock starting at idx. */
+static size_t pageblock_free_pages(const struct zone *zone, uintptr_t idx)
+{
+	/* The whole pageblock might be a part of a larger free block. */
+	for (int order = PAGEBLOCK_ORDER; order <= buddy_top_order;
+				++order) {
+		const uintptr_t first = idx & ~(((uintptr_t)1 << order) - 1);
+
+		if (first < zone->begin)
+			break;
+
+		const struct page *page = &memmap[first];
+
+		if (page_free(page) && page_order(page) >= order)
+			return PAGEBLOCK_PAGES;
+	}
+
+	size_t pages = 0;
+
+	for (uintptr_t i = idx; i < idx + PAGEBLOCK_PAGES;) {
+		const struct page *page = &memmap[i];
+
+		if (!page_free(page)) {
+			++i;
+			continue;
+		}
+
+		const uintptr_t size = (uintptr_t)1 << page_order(page);
+
+		pages += size;
+		i += size;
+	}
+	return pages;
+}
+
+/**
+ * Looks for movable pageblocks with the least number of busy pages (but
+ * not more than a half of the pageblock) in the whole memory, it's the
+ * cheapest way to get free pageblocks.
+ **/
+static size_t buddy_find_blocks(struct page **blocks, size_t *busy,
+			size_t count)
+{
+	struct list_head *head = &buddy_zones;
+	size_t found = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct zone *zone = (struct zone *)ptr;
+		const uintptr_t first = (zone->begin + PAGEBLOCK_PAGES - 1) &
+					~(PAGEBLOCK_PAGES - 1);
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		for (uintptr_t idx = first;
+					idx + PAGEBLOCK_PAGES <= zone->init_end;
+					idx += PAGEBLOCK_PAGES) {
+			struct page *page = &memmap[idx];
+
+			if (page->flags & PAGE_SKIP_MASK)
+				continue;
+			if (pageblock_type(zone, idx) != MIGRATE_MOVABLE)
+				continue;
+
+			const size_t used = PAGEBLOCK_PAGES -
+						pageblock_free_pages(zone, idx);
+
+			if (!used || used > PAGEBLOCK_PAGES / 2)
+				continue;
+			if (found == count && busy[count - 1] <= used)
+				continue;
+
+			/* Keep candidates sorted by number of busy pages. */
+			size_t pos = found < count ? found++ : count - 1;
+
+			for (; pos && busy[pos - 1] > used; --pos) {
+				busy[pos] = busy[pos - 1];
+				blocks[pos] = blocks[pos - 1];
+			}
+			busy[pos] = used;
+			blocks[pos] = page;
+		}
+		spin_unlock_int_restore(&zone->lock, enabled);
+	}
+	return found;
+}
+
+size_t buddy_isolate_blocks(struct page **blocks, size_t count)
+{
+	size_t busy[BUDDY_ISOLATE_MAX];
+
+	if (count > BUDDY_ISOLATE_MAX)
+		count = BUDDY_ISOLATE_MAX;
+
+	/* Pages cached in per-CPU lists look busy, return them to zones. */
+	buddy_drain_all();
+
+	size_t found = buddy_find_blocks(blocks, busy, count);
+
+	/**
+	 * Busy pages need somewhere to go, isolating k pageblocks with b busy
+	 * pages we lose k * PAGEBLOCK_PAGES - b free pages, so we need at
+	 * least k * PAGEBLOCK_PAGES free pages to move everything. Leave one
+	 * more pageblock for other allocations.
+	 **/
+	const size_t limit = buddy_free_pages / PAGEBLOCK_PAGES;
+
+	if (found + 1 > limit)
+		found = limit ? limit - 1 : 0;
+
+	size_t isolated = 0;
+
+	for (size_t i = 0; i != found; ++i) {
+		struct zone *zone = page_zone(blocks[i]);
+		const uintptr_t idx = blocks[i] - memmap;
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		/* Things might have changed while we were looking. */
+		if (pageblock_type(zone, idx) == MIGRATE_MOVABLE) {
+			pageblock_claim(zone, idx, MIGRATE_ISOLATE);
+			blocks[isolated++] = blocks[i];
+		}
+		spin_unlock_int_restore(&zone->lock, enabled);
+	}
+	return isolated;
+}
+
+size_t buddy_release_blocks(struct page **blocks, size_t count)
+{
+	size_t freed = 0;
+
+	for (size_t i = 0; i != count; ++i) {
+		struct page *page = blocks[i];
+		struct zone *zone = page_zone(page);
+		const uintptr_t idx = page - memmap;
+		const int enabled = spin_lock_int_save(&zone->lock);
+
+		if (pageblock_free_pages(zone, idx) == PAGEBLOCK_PAGES)
+			++freed;
+		else
+			page->flags |= PAGE_SKIP_MASK;
+		pageblock_claim(zone, idx, MIGRATE_MOVABLE);
+		spin_unlock_int_restore(&zone->lock, enabled);
+	}
+	return freed;
+}
+
+int buddy_page_isolated(const struct page *page)
+{
+	return page_migrate_type(page) == MIGRATE_ISOLATE;
+}
+
+size_t buddy_free_blocks(void)
+{
+	return buddy_free_pageblocks;
+}
+
+
+/* Returns index of the first page of the free block containing idx. */
+static uintptr_t zone_free_block_of(const struct zone *zone, uintptr_t idx)
+{
+	for (int order = 0; order <= buddy_top_order; ++order) {
+		const uintptr_t first = idx & ~(((uintptr_t)1 << order) - 1);
+
+		if (first < zone->begin)
+			break;
+
+		const struct page *page = &memmap[first];
+
+		if (page_free(page) && page_order(page) >= order)
+			return first;
+	}
+	return PFN_NONE;
+}
+
+static uintptr_t zone_free_block_end(uintptr_t first)
+{
+	return first + ((uintptr_t)1 << page_order(&memmap[first]));
+}
+
+void buddy_set_range_type(uintptr_t begin, uintptr_t end, int type)
+{
+	const uintptr_t from = begin >> PAGE_BITS;
+	const uintptr_t to = end >> PAGE_BITS;
+	struct zone *zone = page_zone(&memmap[from]);
+	const int enabled = spin_lock_int_save(&zone->lock);
+
+	for (uintptr_t idx = from; idx < to; idx += PAGEBLOCK_PAGES)
+		pageblock_claim(zone, idx, type);
+	spin_unlock_int_restore(&zone->lock, enabled);
+
+	/* Pages cached in per-CPU lists look busy, return them to zones. */
+	if (type == MIGRATE_ISOLATE)
+		buddy_drain_all();
+}
+
+int buddy_take_range(uintptr_t begin, uintptr_t end)
+{
+	const uintptr_t from = begin >> PAGE_BITS;
+	const uintptr_t to = end >> PAGE_BITS;
+	struct zone *zone = page_zone(&memmap[from]);
+	const int enabled = spin_lock_int_save(&zone->lock);
+	uintptr_t idx = from;
+
+	while (idx < to) {
+		const uintptr_t first = zone_free_block_of(zone, idx);
+
+		if (first == PFN_NONE)
+			break;
+		idx = zone_free_block_end(first);
+	}
+
+	if (idx < to) {
+		spin_unlock_int_restore(&zone->lock, enabled);
+		return 0;
+	}
+
+	/**
+	 * Free blocks on the borders might stick out of the range, we take
+	 * them whole and return what's outside after all the pages inside
+	 * are busy, so that nothing merges back into the range.
+	 **/
+	const uintptr_t head = zone_free_block_of(zone, from);
+	const uintptr_t tail = zone_free_block_end(
+				zone_free_block_of(zone, to - 1));
+
+	for (idx = from; idx < to;) {
+		const uintptr_t first = zone_free_block_of(zone, idx);
+		const int order = page_order(&memmap[first]);
+
+		zone_del_free(zone, &memmap[first], order);
+		percpu_counter_inc(&zone->stats[order].allocs);
+		idx = first + ((uintptr_t)1 << order);
+	}
+
+	zone_free_range(zone, head, from);
+	zone_free_range(zone, to, tail);
+	spin_unlock_int_restore(&zone->lock, enabled);
+	return 1;
+}
+
+void buddy_free_range(uintptr_t begin, uintptr_t end)
+{
+	const uintptr_t from = begin >> PAGE_BITS;
+	const uintptr_t to = end >> PAGE_BITS;
+	struct zone *zone = page_zone(&memmap[from]);
+	const int enabled = spin_lock_int_save(&zone->lock);
+
+	zone_free_range(zone, from, to);
+	spin_unlock_int_restore(&zone->lock, enabled);
+}
+
+
+/**
+ * Unusable free space index for order j is the fraction of free memory
+ * in blocks smaller than 2^j pages, i.e. free memory useless for an
+ * allocation of order j. Returns it multiplied by 1000.
+ **/
+static unsigned long unusable_index(const unsigned long *free, int order)
+{
+	unsigned long total = 0, usable = 0;
+
+	for (int i = 0; i <= buddy_top_order; ++i) {
+		total += free[i] << i;
+		if (i >= order)
+			usable += free[i] << i;
+	}
+	return total ? (total - usable) * 1000 / total : 0;
+}
+
+static void zone_show(struct file *file, struct zone *zone)
+{
+	unsigned long free[MAX_ORDER + 1];
+	unsigned long pages = 0;
+
+	/* Free counts must be consistent, other counters may be racy. */
+	const int enabled = spin_lock_int_save(&zone->lock);
+
+	for (int i = 0; i <= buddy_top_order; ++i)
+		free[i] = zone->stats[i].free;
+	spin_unlock_int_restore(&zone->lock, enabled);
+
+	for (int i = 0; i <= buddy_top_order; ++i)
+		pages += free[i] << i;
+
+	ramfs_printf(file, "zone %lu (%s): pfn 0x%lx-0x%lx, %lu free pages\n",
+				zone->id, zone_type_name[zone->type],
+				(unsigned long)zone->begin,
+				(unsigned long)zone->end, pages);
+	ramfs_printf(file, "watermarks min %lu low %lu high %lu "
+				"lowmem reserve %lu\n",
+				zone->watermark[WMARK_MIN],
+				zone->watermark[WMARK_LOW],
+				zone->watermark[WMARK_HIGH],
+				zone->lowmem_reserve);
+	ramfs_printf(file, "order free allocs frees splits merges unusable\n");
+	for (int i = 0; i <= buddy_top_order; ++i) {
+		struct zone_stats *stats = &zone->stats[i];
+		const unsigned long index = unusable_index(free, i);
+
+		ramfs_printf(file, "%d %lu %ld %ld %lu %lu %lu.%lu%lu%lu\n",
+					i, free[i],
+					percpu_counter_sum(&stats->allocs),
+					percpu_counter_sum(&stats->frees),
+					stats->splits, stats->merges,
+					index / 1000, index / 100 % 10,
+					index / 10 % 10, index % 10);
+	}
+}
+
+void buddy_show(struct file *file)
+{
+	struct list_head *head = &buddy_zones;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next)
+		zone_show(file, (struct zone *)ptr);
+
+	ramfs_printf(file, "failures");
+	for (int i = 0; i <= buddy_top_order; ++i)
+		ramfs_printf(file, " %lu", buddy_failures[i]);
+	ramfs_printf(file, "\n");
+
+	struct buddy_zero_stats zero;
+
+	buddy_zero_stats(&zero);
+	ramfs_printf(file, "zero pool pages %d hits %lu misses %lu\n",
+				zero.pages, zero.hits, zero.misses);
+}
+
+
+/**
+ * Runs pairs of single page allocations and frees in bursts of burst
+ * pages either through the per-CPU lists or directly on zones (that's what
+ * every allocation did before per-CPU lists), returns cycles per pair.
+ **/
+#define BUDDY_BENCH_PAIRS	65536
+#define BUDDY_BENCH_BURST	64
+
+static unsigned long buddy_bench(int pcp, size_t burst)
+{
+	struct page *pages[BUDDY_BENCH_BURST];
+	size_t pairs = 0;
+	const uint64_t start = rdtsc();
+
+	for (size_t round = 0; round != BUDDY_BENCH_PAIRS / burst; ++round) {
+		size_t got = 0;
+
+		for (; got != burst; ++got) {
+			pages[got] = pcp
+				? pcp_alloc(&buddy_pcp, 0, MIGRATE_UNMOVABLE, 0)
+				: buddy_alloc_zones(0, MIGRATE_UNMOVABLE, 0);
+			if (!pages[got])
+				break;
+		}
+
+		for (size_t i = 0; i != got; ++i) {
+			struct page *page = pages[i];
+
+			if (pcp)
+				pcp_free(&buddy_pcp, page, 0);
+			else
+				buddy_free_zone(page_zone(page), page, 0);
+		}
+		pairs += got;
+	}
+
+	const uint64_t cycles = rdtsc() - start;
+
+	return pairs ? cycles / pairs : 0;
+}
+
+void buddy_bench_show(struct file *file)
+{
+	static const size_t bursts[] = {1, 8, BUDDY_BENCH_BURST};
+
+	ramfs_printf(file, "burst zone pcp\n");
+	for (size_t i = 0; i != sizeof(bursts) / sizeof(bursts[0]); ++i) {
+		const unsigned long zone = buddy_bench(0, bursts[i]);
+		const unsigned long pcp = buddy_bench(1, bursts[i]);
+
+		ramfs_printf(file, "%lu %lu %lu\n",
+					(unsigned long)bursts[i], zone, pcp);
+	}
 }
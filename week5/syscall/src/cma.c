@@ -0,0 +1,163 @@
+#include <cma.h>
+#include <balloc.h>
+#include <buddy.h>
+#include <mm.h>
+#include <mutex.h>
+#include <print.h>
+#include <slab.h>
+#include <string.h>
+
+
+/**
+ * Number of candidate ranges cma_alloc tries, a page we failed to move
+ * (e.g. it's being mapped right now) costs us the whole range, but we
+ * don't want to scan the region forever either.
+ **/
+#define CMA_RETRIES	4
+
+#define CMA_BITS	(sizeof(unsigned long) * 8)
+#define CMA_PAGEBLOCK	((uintptr_t)PAGE_SIZE << PAGEBLOCK_ORDER)
+
+
+/* Bit i of the bitmap is set iff page i of the region is allocated. */
+static struct mutex cma_mtx;
+static unsigned long *cma_bitmap;
+static uintptr_t cma_begin;
+static size_t cma_pages;
+
+/* Physical range being evacuated, see cma_page_move. */
+static uintptr_t cma_move_begin;
+static uintptr_t cma_move_end;
+
+
+static int cma_test(size_t i)
+{
+	return (cma_bitmap[i / CMA_BITS] >> (i % CMA_BITS)) & 1;
+}
+
+static void cma_set(size_t from, size_t to, int set)
+{
+	for (size_t i = from; i != to; ++i) {
+		const unsigned long bit = 1ul << (i % CMA_BITS);
+
+		if (set)
+			cma_bitmap[i / CMA_BITS] |= bit;
+		else
+			cma_bitmap[i / CMA_BITS] &= ~bit;
+	}
+}
+
+/**
+ * Returns the first position >= from aligned on align with pages free
+ * pages after it, or cma_pages if there is no such position.
+ **/
+static size_t cma_find(size_t from, size_t pages, size_t align)
+{
+	size_t pos = (from + align - 1) & ~(align - 1);
+
+	while (pos + pages <= cma_pages) {
+		size_t i = pos;
+
+		while (i != pos + pages && !cma_test(i))
+			++i;
+
+		if (i == pos + pages)
+			return pos;
+		pos = (i + align) & ~(align - 1);
+	}
+	return cma_pages;
+}
+
+static int cma_page_move(const struct page *page)
+{
+	const uintptr_t phys = page_addr(page);
+
+	return phys >= cma_move_begin && phys < cma_move_end;
+}
+
+/**
+ * Isolates pageblocks covering the range, so that pages freed there are
+ * not allocated again, moves busy pages of the range and takes it if
+ * everything is free now.
+ **/
+static int cma_take(uintptr_t begin, uintptr_t end)
+{
+	const uintptr_t from = begin & ~(CMA_PAGEBLOCK - 1);
+	const uintptr_t to = (end + CMA_PAGEBLOCK - 1) & ~(CMA_PAGEBLOCK - 1);
+
+	buddy_set_range_type(from, to, MIGRATE_ISOLATE);
+	cma_move_begin = begin;
+	cma_move_end = end;
+	mm_migrate(&cma_page_move);
+
+	const int taken = buddy_take_range(begin, end);
+
+	buddy_set_range_type(from, to, MIGRATE_CMA);
+	return taken;
+}
+
+uintptr_t cma_alloc(size_t pages)
+{
+	int order = PAGEBLOCK_ORDER;
+
+	if (!pages || !cma_pages)
+		return 0;
+
+	/* Align ranges on the largest power of 2 up to a pageblock. */
+	while (order && ((size_t)1 << order) > pages)
+		--order;
+
+	const size_t align = (size_t)1 << order;
+
+	mutex_lock(&cma_mtx);
+
+	size_t pos = cma_find(0, pages, align);
+
+	for (int retry = 0; retry != CMA_RETRIES && pos != cma_pages;
+				++retry) {
+		const uintptr_t phys = cma_begin + pos * PAGE_SIZE;
+
+		if (cma_take(phys, phys + pages * PAGE_SIZE)) {
+			cma_set(pos, pos + pages, 1);
+			mutex_unlock(&cma_mtx);
+			return phys;
+		}
+		pos = cma_find(pos + align, pages, align);
+	}
+	mutex_unlock(&cma_mtx);
+	return 0;
+}
+
+void cma_free(uintptr_t phys, size_t pages)
+{
+	const size_t pos = (phys - cma_begin) / PAGE_SIZE;
+
+	mutex_lock(&cma_mtx);
+	buddy_free_range(phys, phys + pages * PAGE_SIZE);
+	cma_set(pos, pos + pages, 0);
+	mutex_unlock(&cma_mtx);
+}
+
+void cma_setup(void)
+{
+	struct balloc_range range;
+
+	mutex_setup(&cma_mtx);
+	balloc_cma_range(&range);
+	if (range.begin == range.end)
+		return;
+
+	const size_t pages = (range.end - range.begin) / PAGE_SIZE;
+	const size_t size = (pages + CMA_BITS - 1) / CMA_BITS *
+				sizeof(*cma_bitmap);
+
+	cma_bitmap = kmalloc(size);
+	if (!cma_bitmap) {
+		printf("Failed to allocate CMA bitmap\n");
+		while (1);
+	}
+
+	memset(cma_bitmap, 0, size);
+	cma_begin = range.begin;
+	cma_pages = pages;
+}
@@ -0,0 +1,195 @@
+#include <compact.h>
+#include <buddy.h>
+#include <condition.h>
+#include <mm.h>
+#include <mutex.h>
+#include <print.h>
+#include <ramfs.h>
+#include <threads.h>
+#include <time.h>
+
+
+/**
+ * Background compaction thread (kcompactd) is woken up when there are
+ * less than COMPACT_LOW free pageblocks and tries to get COMPACT_HIGH.
+ **/
+#define COMPACT_LOW	4
+#define COMPACT_HIGH	8
+
+/**
+ * After compaction failed we ignore the next 2^shift requests (but not
+ * more than 2^COMPACT_MAX_DEFER_SHIFT), there is no point in scanning the
+ * whole memory again and again if nothing changes.
+ **/
+#define COMPACT_MAX_DEFER_SHIFT	6
+
+
+static struct mutex compact_mtx;
+static struct compact_stats compact_info;
+
+static struct spinlock compact_lock;
+static struct condition compact_cv;
+static struct thread *kcompactd_thread;
+static int kcompactd_pending;
+static int compact_defer_shift;
+static int compact_considered;
+
+
+/* Both must be called with compact_lock held. */
+static int compact_deferred(void)
+{
+	if (!compact_defer_shift)
+		return 0;
+
+	if (++compact_considered < (1 << compact_defer_shift))
+		return 1;
+
+	compact_considered = 0;
+	return 0;
+}
+
+static void compact_defer(int success)
+{
+	compact_considered = 0;
+	if (success)
+		compact_defer_shift = 0;
+	else if (compact_defer_shift < COMPACT_MAX_DEFER_SHIFT)
+		++compact_defer_shift;
+}
+
+
+size_t compact_memory(size_t blocks)
+{
+	struct page *isolated[BUDDY_ISOLATE_MAX];
+	size_t recovered = 0;
+	size_t moved = 0;
+
+	mutex_lock(&compact_mtx);
+
+	const uint64_t start = rdtsc();
+
+	while (recovered < blocks) {
+		const size_t count = buddy_isolate_blocks(isolated,
+					blocks - recovered);
+
+		if (!count)
+			break;
+
+		moved += mm_migrate(&buddy_page_isolated);
+
+		const size_t freed = buddy_release_blocks(isolated, count);
+
+		recovered += freed;
+		if (!freed)
+			break;
+	}
+
+	const uint64_t cycles = rdtsc() - start;
+
+	++compact_info.runs;
+	compact_info.blocks += recovered;
+	compact_info.pages += moved;
+	compact_info.cycles += cycles;
+	compact_info.last_blocks = recovered;
+	compact_info.last_pages = moved;
+	compact_info.last_cycles = cycles;
+	mutex_unlock(&compact_mtx);
+
+	return recovered;
+}
+
+int compact_direct(void)
+{
+	int enabled = spin_lock_int_save(&compact_lock);
+	const int deferred = compact_deferred();
+
+	spin_unlock_int_restore(&compact_lock, enabled);
+	if (deferred)
+		return 0;
+
+	const int success = compact_memory(1) != 0;
+
+	enabled = spin_lock_int_save(&compact_lock);
+	compact_defer(success);
+	spin_unlock_int_restore(&compact_lock, enabled);
+	return success;
+}
+
+void compact_wakeup(void)
+{
+	if (!kcompactd_thread || buddy_free_blocks() >= COMPACT_LOW)
+		return;
+
+	const int enabled = spin_lock_int_save(&compact_lock);
+
+	if (!kcompactd_pending && !compact_deferred()) {
+		kcompactd_pending = 1;
+		notify_one(&compact_cv);
+	}
+	spin_unlock_int_restore(&compact_lock, enabled);
+}
+
+void compact_stats(struct compact_stats *stats)
+{
+	mutex_lock(&compact_mtx);
+	*stats = compact_info;
+	mutex_unlock(&compact_mtx);
+}
+
+void compact_show(struct file *file)
+{
+	struct compact_stats stats;
+
+	compact_stats(&stats);
+	ramfs_printf(file, "runs blocks pages cycles "
+				"last_blocks last_pages last_cycles\n");
+	ramfs_printf(file, "%lu %lu %lu %llu %lu %lu %llu\n",
+				stats.runs, stats.blocks, stats.pages,
+				(unsigned long long)stats.cycles,
+				stats.last_blocks, stats.last_pages,
+				(unsigned long long)stats.last_cycles);
+}
+
+
+static int kcompactd(void *unused)
+{
+	(void) unused;
+
+	while (1) {
+		int enabled = spin_lock_int_save(&compact_lock);
+
+		while (!kcompactd_pending)
+			condition_wait_spin_int(&compact_cv, &compact_lock);
+		kcompactd_pending = 0;
+		spin_unlock_int_restore(&compact_lock, enabled);
+
+		const size_t free = buddy_free_blocks();
+
+		if (free >= COMPACT_HIGH)
+			continue;
+
+		const size_t recovered = compact_memory(COMPACT_HIGH - free);
+
+		enabled = spin_lock_int_save(&compact_lock);
+		compact_defer(recovered != 0);
+		spin_unlock_int_restore(&compact_lock, enabled);
+	}
+	return 0;
+}
+
+void compact_setup(void)
+{
+	mutex_setup(&compact_mtx);
+	spin_setup(&compact_lock);
+	condition_setup(&compact_cv);
+
+	struct thread *thread = thread_create(&kcompactd, 0);
+
+	if (!thread) {
+		printf("Failed to create compaction thread\n");
+		while (1);
+	}
+
+	thread_start(thread);
+	kcompactd_thread = thread;
+}
@@ -5,6 +5,7 @@
 #include <mm.h>
 #include <paging.h>
 #include <ramfs.h>
+#include <slab.h>
 #include <stdint.h>
 #include <string.h>
 #include <threads.h>
@@ -148,7 +149,8 @@ static unsigned segment_flags(unsigned long flags)
 static int segment_map(struct mm *mm, struct elf_phdr *hdr, struct file *file)
 {
 	const unsigned perm = segment_flags(hdr->p_flags);
-	const uintptr_t phys = buddy_alloc(0);
+	const size_t bufsize = hdr->p_filesz < PAGE_SIZE
+				? hdr->p_filesz : PAGE_SIZE;
 
 	const uintptr_t mask = ~((uintptr_t)PAGE_SIZE - 1);
 	const uintptr_t from = hdr->p_vaddr & mask;
@@ -156,32 +158,30 @@ static int segment_map(struct mm *mm, struct elf_phdr *hdr, struct file *file)
 				& mask;
 
 	struct mm *me = thread_current()->mm;
-	void *buf = va(phys);
+	void *buf = kmalloc(bufsize);
 	uintptr_t addr = hdr->p_vaddr;
 	size_t size = hdr->p_filesz;
 	long offs = hdr->p_offset;
 
-	if (!phys) {
-		buddy_free(phys, 0);
+	if (!buf)
 		return -1;
-	}
 
 	if (mmap(mm, from, to, perm)) {
-		buddy_free(phys, 0);
+		kfree(buf);
 		return -1;
 	}
 
 	while (size) {
-		const long toread = size < PAGE_SIZE ? size : PAGE_SIZE;
+		const long toread = size < bufsize ? size : bufsize;
 		const long read = ramfs_readat(file, buf, toread, offs);
 
 		if (read != toread) {
-			buddy_free(phys, 0);
+			kfree(buf);
 			return -1;
 		}
 
 		if (mcopy(mm, addr, me, (uintptr_t)buf, toread)) {
-			buddy_free(phys, 0);
+			kfree(buf);
 			return -1;
 		}
 
@@ -189,12 +189,11 @@ static int segment_map(struct mm *mm, struct elf_phdr *hdr, struct file *file)
 		addr += toread;
 	}
 
-	if (mset(mm, addr, 0, hdr->p_memsz - hdr->p_filesz)) {
-		buddy_free(phys, 0);
-		return -1;
-	}
-
-	buddy_free(phys, 0);
+	/**
+	 * We don't need to clear the rest of the segment (BSS), since mmap
+	 * gives us zero filled pages and mappings never overlap.
+	 **/
+	kfree(buf);
 	return 0;
 }
 
@@ -2,6 +2,8 @@
 
 #include <buddy.h>
 #include <balloc.h>
+#include <cma.h>
+#include <compact.h>
 #include <exec.h>
 #include <initramfs.h>
 #include <ints.h>
@@ -10,13 +12,17 @@
 #include <misc.h>
 #include <mm.h>
 #include <paging.h>
+#include <percpu.h>
+#include <proc.h>
 #include <print.h>
 #include <ramfs.h>
+#include <reclaim.h>
 #include <slab.h>
 #include <string.h>
 #include <threads.h>
 #include <time.h>
 #include <vga.h>
+#include <vmalloc.h>
 
 
 static void qemu_gdb_hang(void)
@@ -47,17 +53,26 @@ void main(uintptr_t mb_info_phys)
 	const struct multiboot_info *info = va(mb_info_phys);
 
 	qemu_gdb_hang();
+	percpu_setup();
 	vga_clr();
 	misc_setup(info);
 	ints_setup();
 	balloc_setup();
 	paging_setup();
 	buddy_setup();
+	slab_setup();
+	vmalloc_setup();
+	cma_setup();
 	mm_setup();
 	ramfs_setup();
 	initramfs_setup();
+	proc_setup();
 	time_setup();
 	scheduler_setup();
+	buddy_init_late();
+	compact_setup();
+	reclaim_setup();
+	slab_reap_setup();
 
 	struct thread *thread = thread_create(&init, 0);
 
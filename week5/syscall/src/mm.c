@@ -5,11 +5,13 @@
 #include <paging.h>
 #include <slab.h>
 #include <string.h>
+#include <threads.h>
 
 
-static const uint64_t USER_MASK = 0x0000ffffffffffffull;
 static struct slab_cache mm_slab;
 static struct slab_cache vma_slab;
+static struct spinlock mm_lock;
+static struct list_head mm_list;
 
 
 struct mm *mm_create(void)
@@ -19,8 +21,7 @@ struct mm *mm_create(void)
 	if (!mm)
 		return NULL;
 
-	list_init(&mm->vmas);
-	mm->pt = __buddy_alloc(0);
+	mm->pt = __buddy_alloc(0, BUDDY_ZERO);
 
 	if (!mm->pt) {
 		slab_cache_free(&mm_slab, mm);
@@ -31,21 +32,29 @@ struct mm *mm_create(void)
 
 	/**
 	 * kernel part of the mapping is the same for every process
-	 * and never changes so we need to copy it from the initial
+	 * and never changes so we need to copy it from the initial,
+	 * it's the upper half of the root table (see pt_migrate)
 	 **/
-	const size_t offs = pt_index(HIGHER_BASE, 4) * sizeof(pte_t);
+	const size_t offs = PAGE_SIZE / 2;
 	char *ptr = va(mm->cr3);
 
-	memset(ptr, 0, PAGE_SIZE);
 	memcpy(ptr + offs, va(initial_cr3 + offs), PAGE_SIZE - offs);
 
+	spin_lock(&mm_lock);
+	list_add_tail(&mm->ll, &mm_list);
+	spin_unlock(&mm_lock);
+
 	return mm;
 }
 
 
 void mm_release(struct mm *mm)
 {
-	munmap(mm, 0, HIGHER_BASE & USER_MASK);
+	spin_lock(&mm_lock);
+	list_del(&mm->ll);
+	spin_unlock(&mm_lock);
+
+	munmap(mm, 0, pt_user_end());
 	__buddy_free(mm->pt, 0);
 	slab_cache_free(&mm_slab, mm);
 }
@@ -63,12 +72,18 @@ int mset(struct mm *dst, uintptr_t to, int c, size_t size)
 		const size_t toset = MIN(pg, size);
 		#undef MIN
 
+		/* the page must not be moved while we are using it */
+		preempt_disable();
+
 		const uintptr_t d = pt_addr(pt, ptr);
 
-		if (!d)
+		if (!d) {
+			preempt_enable();
 			return -1;
+		}
 
 		memset(va(d), c, toset);
+		preempt_enable();
 		ptr += toset;
 		size -= toset;
 	}
@@ -93,13 +108,19 @@ int mcopy(struct mm *dst, uintptr_t to, struct mm *src, uintptr_t from,
 		const size_t tocopy = MIN(MIN(dst_pg, src_pg), size);
 		#undef MIN
 
+		/* pages must not be moved while we are using them */
+		preempt_disable();
+
 		const uintptr_t d = pt_addr(dst_pt, dst_ptr);
 		const uintptr_t s = pt_addr(src_pt, src_ptr);
 
-		if (!s || !d)
+		if (!s || !d) {
+			preempt_enable();
 			return -1;
+		}
 
 		memcpy(va(d), va(s), tocopy);
+		preempt_enable();
 		dst_ptr += tocopy;
 		src_ptr += tocopy;
 		size -= tocopy;
@@ -107,26 +128,51 @@ int mcopy(struct mm *dst, uintptr_t to, struct mm *src, uintptr_t from,
 	return 0;
 }
 
+/* VMA descriptors are allocated and freed in batches of this size. */
+#define MM_VMA_BULK	16
+
+static int __mmap(struct mm *mm, struct vma *vma, uintptr_t from,
+			uintptr_t to, unsigned perm);
+static int __munmap(struct mm *mm, uintptr_t from, uintptr_t to);
+
 int mm_copy(struct mm *dst, struct mm *src)
 {
 	struct list_head *head = &src->vmas;
+	void *vmas[MM_VMA_BULK];
+	size_t count = 0, used = 0;
+
+	mutex_lock(&dst->lock);
 
 	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
 		struct vma *vma = (struct vma *)ptr;
 
-		if (mmap(dst, vma->begin, vma->end, vma->perm)) {
-			munmap(dst, 0, HIGHER_BASE & USER_MASK);
+		if (used == count) {
+			count = slab_cache_alloc_bulk(&vma_slab, MM_VMA_BULK,
+						vmas);
+			used = 0;
+		}
+
+		if (used == count || __mmap(dst, vmas[used], vma->begin,
+					vma->end, vma->perm)) {
+			slab_cache_free_bulk(&vma_slab, count - used,
+						vmas + used);
+			__munmap(dst, 0, pt_user_end());
+			mutex_unlock(&dst->lock);
 			return -1;
 		}
+		++used;
 
 		/* mcopy can only fail if there is no mapping */
 		mcopy(dst, vma->begin, src, vma->begin, vma->end - vma->begin);
 	}
+	slab_cache_free_bulk(&vma_slab, count - used, vmas + used);
+	mutex_unlock(&dst->lock);
 	return 0;
 }
 
 
-int munmap(struct mm *mm, uintptr_t from, uintptr_t to)
+/* Both __munmap and __mmap must be called with the mm lock held. */
+static int __munmap(struct mm *mm, uintptr_t from, uintptr_t to)
 {
 	struct list_head *head = &mm->vmas;
 	struct list_head *prev = head;
@@ -166,21 +212,35 @@ int munmap(struct mm *mm, uintptr_t from, uintptr_t to)
 		next->prev = prev;
 	}
 
-	for (struct list_head *ptr = lst.next; ptr != &lst;) {
-		struct vma *vma = (struct vma *)ptr;
+	void *vmas[MM_VMA_BULK];
+	size_t count = 0;
 
-		ptr = ptr->next;
-		slab_cache_free(&vma_slab, vma);
+	for (struct list_head *ptr = lst.next; ptr != &lst; ptr = ptr->next) {
+		if (count == MM_VMA_BULK) {
+			slab_cache_free_bulk(&vma_slab, count, vmas);
+			count = 0;
+		}
+		vmas[count++] = ptr;
 	}
+	slab_cache_free_bulk(&vma_slab, count, vmas);
 
 	from = 0;
-	to = HIGHER_BASE & USER_MASK;
+	to = pt_user_end();
 	if (prev != head) from = ((struct vma *)prev)->end;
 	if (next != head) to = ((struct vma *)next)->begin;
 	pt_unmap(va(mm->cr3), from, to - from);
 	return 0;
 }
 
+int munmap(struct mm *mm, uintptr_t from, uintptr_t to)
+{
+	mutex_lock(&mm->lock);
+	const int ret = __munmap(mm, from, to);
+	mutex_unlock(&mm->lock);
+
+	return ret;
+}
+
 static pte_t user_flags(unsigned perm)
 {
 	pte_t flags = PTE_USER | PTE_PRESENT;
@@ -190,40 +250,25 @@ static pte_t user_flags(unsigned perm)
 	return flags;
 }
 
-int mmap(struct mm *mm, uintptr_t from, uintptr_t to, unsigned perm)
+/* Maps non empty [from; to) using the given descriptor. */
+static int __mmap(struct mm *mm, struct vma *vma, uintptr_t from,
+			uintptr_t to, unsigned perm)
 {
-	if (to > HIGHER_BASE)
-		return -1;
-
-	from &= USER_MASK;
-	to &= USER_MASK;
-
-	if (from == to)
-		return 0;
-
-	if (from > to)
-		return -1;
-
 	const pte_t flags = user_flags(perm);
 	struct list_head *head = &mm->vmas;
 	struct list_head *next = head->next;
 
 	for (; next != head; next = next->next) {
-		struct vma *vma = (struct vma *)next;
+		const struct vma *p = (struct vma *)next;
 
-		if (vma->begin >= to)
+		if (p->begin >= to)
 			break;
 
 		/* we don't allow overlapped mappings */
-		if (vma->end > from && vma->begin < to)
+		if (p->end > from && p->begin < to)
 			return -1;
 	}
 
-	struct vma *vma = slab_cache_alloc(&vma_slab);
-
-	if (!vma)
-		return -1;
-
 	if (pt_map(va(mm->cr3), from, to - from, flags)) {
 		/**
 		 * This part is really tricky, the problem is that when we
@@ -242,7 +287,7 @@ int mmap(struct mm *mm, uintptr_t from, uintptr_t to, unsigned perm)
 		 * internal pages that can be released would be inside the
 		 * unmapped region, that is why i keep track of vmas.
 		 **/
-		uintptr_t begin = 0, end = HIGHER_BASE & USER_MASK;
+		uintptr_t begin = 0, end = pt_user_end();
 
 		if (next->prev != head) {
 			const struct vma *p = (struct vma *)next->prev;
@@ -267,9 +312,81 @@ int mmap(struct mm *mm, uintptr_t from, uintptr_t to, unsigned perm)
 	return 0;
 }
 
+int mmap(struct mm *mm, uintptr_t from, uintptr_t to, unsigned perm)
+{
+	if (to > pt_user_end())
+		return -1;
+
+	if (from == to)
+		return 0;
+
+	if (from > to)
+		return -1;
+
+	struct vma *vma = slab_cache_alloc(&vma_slab);
+
+	if (!vma)
+		return -1;
+
+	mutex_lock(&mm->lock);
+	const int ret = __mmap(mm, vma, from, to, perm);
+	mutex_unlock(&mm->lock);
+
+	if (ret)
+		slab_cache_free(&vma_slab, vma);
+	return ret;
+}
+
+
+size_t mm_migrate(int (*move)(const struct page *))
+{
+	const uintptr_t cr3 = thread_current()->mm->cr3;
+	struct list_head *head = &mm_list;
+	size_t moved = 0;
+
+	/**
+	 * The lock disables preemption, so user threads can't touch their
+	 * memory and mset/mcopy (that disable preemption as well) can't be
+	 * in the middle of a page. Page tables might be in the middle of
+	 * a change though, so we skip address spaces whose lock is taken,
+	 * they will be migrated next time.
+	 **/
+	spin_lock(&mm_lock);
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct mm *mm = (struct mm *)ptr;
+
+		if (!mutex_trylock(&mm->lock))
+			continue;
+
+		const int err = pt_migrate(va(mm->cr3), move, mm->cr3 == cr3,
+					&moved);
+
+		mutex_unlock(&mm->lock);
+		if (err)
+			break;
+	}
+	spin_unlock(&mm_lock);
+	return moved;
+}
+
+
+/**
+ * munmap in mm_release leaves vmas list empty and the lock free, as
+ * constructed.
+ **/
+static void mm_ctor(void *ptr)
+{
+	struct mm *mm = ptr;
+
+	mutex_setup(&mm->lock);
+	list_init(&mm->vmas);
+}
 
 void mm_setup(void)
 {
-	slab_cache_setup(&mm_slab, sizeof(struct mm));
-	slab_cache_setup(&vma_slab, sizeof(struct vma));
+	spin_setup(&mm_lock);
+	list_init(&mm_list);
+	__slab_cache_setup(&mm_slab, "mm", sizeof(struct mm),
+				SLAB_DEFAULT_ALIGN, &mm_ctor, 0, 0);
+	slab_cache_setup(&vma_slab, "vma", sizeof(struct vma));
 }
@@ -43,6 +43,19 @@ void mutex_lock(struct mutex *mutex)
 	spin_unlock(&mutex->lock);
 }
 
+int mutex_trylock(struct mutex *mutex)
+{
+	int locked = 0;
+
+	spin_lock(&mutex->lock);
+	if (!mutex->owner) {
+		mutex->owner = thread_current();
+		locked = 1;
+	}
+	spin_unlock(&mutex->lock);
+	return locked;
+}
+
 void mutex_unlock(struct mutex *mutex)
 {
 	spin_lock(&mutex->lock);
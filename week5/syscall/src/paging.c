@@ -1,24 +1,29 @@
 #include <paging.h>
 #include <balloc.h>
 #include <buddy.h>
+#include <compact.h>
 #include <memory.h>
 #include <print.h>
 #include <string.h>
 
 
 uintptr_t initial_cr3;
+int pt_levels = 4;
+
+/* Number of entries in a page table of any level. */
+#define PT_SIZE		512
 
 
 static int pt_shift(int lvl)
 {
-	static const int offs[] = {0, 12, 21, 30, 39};
+	static const int offs[] = {0, 12, 21, 30, 39, 48};
 
 	return offs[lvl];
 }
 
 size_t pt_index(uintptr_t addr, int lvl)
 {
-	static const int mask[] = {0xfff, 0x1ff, 0x1ff, 0x1ff, 0x1ff};
+	static const int mask[] = {0xfff, 0x1ff, 0x1ff, 0x1ff, 0x1ff, 0x1ff};
 
 	return (addr >> pt_shift(lvl)) & mask[lvl];
 }
@@ -35,11 +40,11 @@ static size_t pt_order(int lvl)
 
 uintptr_t pt_addr(const pte_t *pml4, uintptr_t addr)
 {
-	uintptr_t mask = 0xffffffffffffull;
+	uintptr_t mask = (pt_size(pt_levels) << 9) - 1;
 	uintptr_t phys = pa(pml4);
 	const pte_t *pt = pml4;
 
-	for (int i = 4; i != 0; --i) {
+	for (int i = pt_levels; i != 0; --i) {
 		const pte_t pte = pt[pt_index(addr, i)];
 
 		if (!(pte & PTE_PRESENT))
@@ -54,19 +59,10 @@ uintptr_t pt_addr(const pte_t *pml4, uintptr_t addr)
 	return phys | (addr & mask);
 }
 
+/* Callers must handle failures, memory might be exhausted. */
 static pte_t pt_alloc(void)
 {
-	const uintptr_t phys = buddy_alloc(0);
-
-	if (!phys) {
-		printf("Failed to allocate a page for initial page table\n");
-		while (1);
-	}
-
-	void *vaddr = va(phys);
-
-	memset(vaddr, 0, PAGE_SIZE);
-	return phys;
+	return buddy_alloc(0, BUDDY_ZERO);
 }
 
 static void pt_free(uintptr_t phys)
@@ -75,6 +71,48 @@ static void pt_free(uintptr_t phys)
 }
 
 
+/**
+ * Leaf pages of the last level page table are allocated and released in
+ * batches of this size, so that mapping of a large range doesn't need to
+ * go into the buddy allocator for every page.
+ **/
+#define PT_BULK_SIZE	64
+
+static int pt_map_pages(pte_t *pt, int from, int to, pte_t flags)
+{
+	uintptr_t pages[PT_BULK_SIZE];
+	size_t count = 0, used = 0;
+	int err = 0;
+
+	for (int i = from; i != to; ++i) {
+		if (pt[i] & PTE_PRESENT)
+			continue;
+
+		if (used == count) {
+			#define MIN(a, b) ((a) < (b) ? (a) : (b))
+			const size_t todo = MIN(to - i, PT_BULK_SIZE);
+			#undef MIN
+
+			count = buddy_alloc_bulk(0, BUDDY_ZERO | BUDDY_MOVABLE,
+						todo, pages);
+			used = 0;
+			if (!count) {
+				err = -1;
+				break;
+			}
+		}
+		pt[i] = (pte_t)pages[used++] | flags;
+	}
+
+	/* We might allocate more than needed if some pages were present. */
+	buddy_free_bulk(0, count - used, pages + used);
+	return err;
+}
+
+/**
+ * pt_map is used only for user memory, so all leaf pages it allocates are
+ * movable, while page tables themselves are not.
+ **/
 static int __pt_map(pte_t *pt, uint64_t virt, uint64_t size, pte_t pte_flags,
 			int lvl)
 {
@@ -88,6 +126,9 @@ static int __pt_map(pte_t *pt, uint64_t virt, uint64_t size, pte_t pte_flags,
 	const int from = pt_index(virt, lvl);
 	const int to = pt_index(virt + size - 1, lvl) + 1;
 
+	if (lvl == 1)
+		return pt_map_pages(pt, from, to, pte_flags);
+
 	for (int i = from; i != to; ++i) {
 		#define MIN(a, b) ((a) < (b) ? (a) : (b))
 		const uint64_t eend = (virt + esize) & ~emask;
@@ -95,24 +136,30 @@ static int __pt_map(pte_t *pt, uint64_t virt, uint64_t size, pte_t pte_flags,
 		#undef MIN
 
 		const int notaligned = virt & emask;
-		const int leaf = (lvl == 1) || (pte_large && tomap == esize
-					&& !notaligned);
+		const int leaf = pte_large && tomap == esize && !notaligned;
 		pte_t pte = pt[i];
 
 		if (!(pte & PTE_PRESENT)) {
 			if (leaf) {
-				const uintptr_t phys = buddy_alloc(order);
+				uintptr_t phys = buddy_alloc(order,
+						BUDDY_ZERO | BUDDY_MOVABLE);
 				const pte_t flags = pte_flags | pte_large;
 
+				/**
+				 * Rather than fall back to small pages try to
+				 * get a free pageblock moving pages around.
+				 **/
+				if (!phys && order == PAGEBLOCK_ORDER &&
+							compact_direct())
+					phys = buddy_alloc(order,
+						BUDDY_ZERO | BUDDY_MOVABLE);
+
 				if (phys) {
 					pt[i] = (pte_t)phys | flags;
 					virt += tomap;
 					size -= tomap;
 					continue;
 				}
-
-				if (lvl == 1)
-					return -1;
 			}
 
 			if (!(pte = pt_alloc()))
@@ -122,7 +169,7 @@ static int __pt_map(pte_t *pt, uint64_t virt, uint64_t size, pte_t pte_flags,
 			pt[i] = pte;
 		}
 
-		if (lvl > 1 && __pt_map(va(pte & PTE_PHYS_MASK), virt, tomap,
+		if (__pt_map(va(pte & PTE_PHYS_MASK), virt, tomap,
 					pte_flags, lvl - 1))
 			return -1;
 
@@ -134,7 +181,79 @@ static int __pt_map(pte_t *pt, uint64_t virt, uint64_t size, pte_t pte_flags,
 
 int pt_map(pte_t *pml4, uintptr_t vaddr, size_t size, pte_t flags)
 {
-	return __pt_map(pml4, vaddr, size, flags, 4);
+	return __pt_map(pml4, vaddr, size, flags, pt_levels);
+}
+
+static int __pt_migrate(pte_t *pt, uintptr_t vaddr, int count, int lvl,
+			int (*move)(const struct page *), int flush,
+			size_t *moved)
+{
+	for (int i = 0; i != count; ++i, vaddr += pt_size(lvl)) {
+		const pte_t pte = pt[i];
+		const uintptr_t phys = pte & PTE_PHYS_MASK;
+
+		if (!(pte & PTE_PRESENT))
+			continue;
+
+		if (lvl != 1) {
+			/* large pages are never moved */
+			if (pte & PTE_LARGE)
+				continue;
+
+			if (__pt_migrate(va(phys), vaddr, PT_SIZE, lvl - 1,
+						move, flush, moved))
+				return -1;
+			continue;
+		}
+
+		struct page *page = addr_page(phys);
+
+		if (!move(page))
+			continue;
+
+		struct page *new = __buddy_alloc(0, BUDDY_MOVABLE);
+
+		if (!new)
+			return -1;
+
+		memcpy(va(page_addr(new)), va(phys), PAGE_SIZE);
+		pt[i] = (pte_t)page_addr(new) | (pte & ~PTE_PHYS_MASK);
+		if (flush)
+			flush_tlb_addr(vaddr);
+		__buddy_free(page, 0);
+		++*moved;
+	}
+	return 0;
+}
+
+int pt_migrate(pte_t *pml4, int (*move)(const struct page *), int flush,
+			size_t *moved)
+{
+	/* The user part is the lower half of the root table. */
+	return __pt_migrate(pml4, 0, PT_SIZE / 2, pt_levels, move,
+				flush, moved);
+}
+
+static void pt_unmap_pages(pte_t *pt, int from, int to)
+{
+	uintptr_t pages[PT_BULK_SIZE];
+	size_t count = 0;
+
+	for (int i = from; i != to; ++i) {
+		const pte_t pte = pt[i];
+
+		if (!(pte & PTE_PRESENT))
+			continue;
+
+		pages[count++] = pte & PTE_PHYS_MASK;
+		pt[i] = 0;
+
+		if (count == PT_BULK_SIZE) {
+			buddy_free_bulk(0, count, pages);
+			count = 0;
+		}
+	}
+	buddy_free_bulk(0, count, pages);
 }
 
 static void __pt_unmap(pte_t *pt, uintptr_t vaddr, size_t size, int lvl)
@@ -145,6 +264,11 @@ static void __pt_unmap(pte_t *pt, uintptr_t vaddr, size_t size, int lvl)
 	const int from = pt_index(vaddr, lvl);
 	const int to = pt_index(vaddr + size - 1, lvl) + 1;
 
+	if (lvl == 1) {
+		pt_unmap_pages(pt, from, to);
+		return;
+	}
+
 	for (int i = from; i != to; ++i) {
 		#define MIN(a, b) ((a) < (b) ? (a) : (b))
 		const uint64_t eend = (vaddr + esize) & ~emask;
@@ -154,23 +278,21 @@ static void __pt_unmap(pte_t *pt, uintptr_t vaddr, size_t size, int lvl)
 		const pte_t pte = pt[i];
 		const uintptr_t phys = pte & PTE_PHYS_MASK;
 
-		if (!(pte & PTE_PRESENT))
-			continue;
-
-		if (lvl == 1 || (pte & PTE_LARGE)) {
+		if (!(pte & PTE_PRESENT)) {
+			/* nothing mapped here */
+		} else if (pte & PTE_LARGE) {
 			buddy_free(phys, pt_order(lvl));
 			pt[i] = 0;
-			continue;
-		}
-
-		__pt_unmap(va(phys), vaddr, tounmap, lvl - 1);
-		/**
-		 * if the whole the subtree completely inside then
-		 * release inner page table too
-		 **/
-		if (tounmap == esize) {
-			pt_free(phys);
-			pt[i] = 0;
+		} else {
+			__pt_unmap(va(phys), vaddr, tounmap, lvl - 1);
+			/**
+			 * if the whole the subtree completely inside then
+			 * release inner page table too
+			 **/
+			if (tounmap == esize) {
+				pt_free(phys);
+				pt[i] = 0;
+			}
 		}
 		vaddr += tounmap;
 		size -= tounmap;
@@ -179,20 +301,93 @@ static void __pt_unmap(pte_t *pt, uintptr_t vaddr, size_t size, int lvl)
 
 void pt_unmap(pte_t *pml4, uintptr_t vaddr, size_t size)
 {
-	__pt_unmap(pml4, vaddr, size, 4);
+	__pt_unmap(pml4, vaddr, size, pt_levels);
+}
+
+
+/**
+ * Returns the entry of the level lvl table for the kernel address vaddr
+ * allocating missing tables on the way, or 0 if we run out of memory.
+ **/
+static pte_t *pt_kernel_entry(uintptr_t vaddr, int lvl)
+{
+	pte_t *pt = va(initial_cr3);
+
+	for (int i = pt_levels; i != lvl; --i) {
+		pte_t *pte = &pt[pt_index(vaddr, i)];
+
+		if (!(*pte & PTE_PRESENT)) {
+			const pte_t phys = pt_alloc();
+
+			if (!phys)
+				return 0;
+			*pte = phys | PTE_PRESENT | PTE_WRITE;
+		}
+		pt = va(*pte & PTE_PHYS_MASK);
+	}
+	return &pt[pt_index(vaddr, lvl)];
+}
+
+int pt_prepare_kernel(uintptr_t vaddr, size_t size)
+{
+	const uintptr_t step = pt_size(4);
+
+	for (uintptr_t addr = vaddr; addr < vaddr + size; addr += step) {
+		if (!pt_kernel_entry(addr, 3))
+			return -1;
+	}
+	return 0;
+}
+
+int pt_map_kernel(uintptr_t vaddr, size_t count, const uintptr_t *pages,
+			pte_t flags)
+{
+	pte_t *pte = 0;
+
+	/* Allocate tables first, so we either map everything or nothing. */
+	for (size_t i = 0; i != count; ++i) {
+		const uintptr_t addr = vaddr + i * PAGE_SIZE;
+
+		if ((!i || !pt_index(addr, 1)) && !pt_kernel_entry(addr, 1))
+			return -1;
+	}
+
+	for (size_t i = 0; i != count; ++i, vaddr += PAGE_SIZE) {
+		/* Walk from the root only when we get to the next table. */
+		if (!pte || !pt_index(vaddr, 1))
+			pte = pt_kernel_entry(vaddr, 1);
+		*pte++ = (pte_t)pages[i] | flags | PTE_PRESENT;
+	}
+	return 0;
+}
+
+void pt_unmap_kernel(uintptr_t vaddr, size_t count, uintptr_t *pages)
+{
+	pte_t *pte = 0;
+
+	for (size_t i = 0; i != count; ++i, vaddr += PAGE_SIZE) {
+		/* Tables are already there, so it never allocates. */
+		if (!pte || !pt_index(vaddr, 1))
+			pte = pt_kernel_entry(vaddr, 1);
+		pages[i] = *pte & PTE_PHYS_MASK;
+		*pte++ = 0;
+	}
 }
 
 
+/**
+ * Physical memory below this address has a logical address in the page
+ * table we are running on. bootstrap.S maps only lower 4GB of the physical
+ * memory and paging_setup extends the mapping step by step, so page tables
+ * must take free memory from there, otherwise we wouldn't have a logical
+ * address to use.
+ **/
+static uintptr_t pt_early_mapped = BOOTSTRAP_MAP_SIZE;
+
 static pte_t pt_early_alloc(void)
 {
-	/**
-	 * bootstrap.S maps only lower 4GB of the physical memory, so
-	 * all allocations during setup of the initial page table should
-	 * take free memory from there, otherwise we wouldn't have a
-	 * logical address to use.
-	 **/
 	const uintptr_t from = 0;
-	const uintptr_t to = (uintptr_t)1 << 32;
+	const uintptr_t to = pt_early_mapped - PAGE_SIZE;
 
 	const uintptr_t phys = __balloc_alloc(from, to, PAGE_SIZE, PAGE_SIZE);
 
@@ -265,26 +460,59 @@ static void __pt_map_to(pte_t *pt, uint64_t virt, uint64_t size,
 static void pt_map_to(pte_t *pt, uintptr_t virt, uintptr_t size,
 			uintptr_t phys, pte_t flags)
 {
-	__pt_map_to(pt, virt, size, phys, flags | PTE_PRESENT, 4);
+	__pt_map_to(pt, virt, size, phys, flags | PTE_PRESENT, pt_levels);
+}
+
+void pt_map_early(uintptr_t virt, size_t size, uintptr_t phys, pte_t flags)
+{
+	pt_map_to(va(initial_cr3), virt, size, phys, flags);
 }
 
 
 void paging_setup(void)
 {
 	const uintptr_t mask = ~(uintptr_t)PAGE_MASK;
-	const uintptr_t phys = pt_early_alloc();
 	const uintptr_t gb = (uintptr_t)1024 * 1024 * 1024;
 
+	if (cr4_read() & CR4_LA57)
+		pt_levels = 5;
+	printf("%d-level paging\n", pt_levels);
+
+	const uintptr_t phys = pt_early_alloc();
 	pte_t *pt = va(phys);
 
-	const uintptr_t e = balloc_phys_mem() & mask;
-	const uintptr_t b = 0;
+	/**
+	 * The direct map can take everything up to the vmalloc area, memory
+	 * above DIRECT_MAP_SIZE is not used (see zone_type_end in buddy.c).
+	 **/
+	const uintptr_t limit = DIRECT_MAP_SIZE;
+	uintptr_t e = balloc_phys_mem() & mask;
+
+	if (e > limit)
+		e = limit;
 
-	printf("map [0x%llx-0x%llx]\n", (unsigned long long)b,
-				(unsigned long long)e);
-	pt_map_to(pt, HIGHER_BASE + b, e - b, b, PTE_WRITE);
+	uintptr_t b = e < BOOTSTRAP_MAP_SIZE ? e : BOOTSTRAP_MAP_SIZE;
 
+	printf("map [0x%llx-0x%llx]\n", 0ull, (unsigned long long)e);
+
+	/**
+	 * At first we map only what bootstrap.S mapped and switch to the new
+	 * page table, then map the rest in steps, each step doubles mapped
+	 * memory and takes page tables from memory mapped by previous ones.
+	 * So no matter how large the memory is we never run out of memory
+	 * with a logical address.
+	 **/
+	pt_map_to(pt, HIGHER_BASE, b, 0, PTE_WRITE);
 	pt_map_to(pt, VIRTUAL_BASE, 2 * gb, 0, PTE_WRITE);
 	initial_cr3 = phys;
 	cr3_write(phys);
+	pt_early_mapped = b;
+
+	while (b < e) {
+		const uintptr_t step = b < e - b ? b : e - b;
+
+		pt_map_to(pt, HIGHER_BASE + b, step, b, PTE_WRITE);
+		b += step;
+		pt_early_mapped = b;
+	}
 }
@@ -0,0 +1,296 @@
+#include <percpu.h>
+#include <ints.h>
+#include <list.h>
+#include <memory.h>
+#include <mutex.h>
+#include <slab.h>
+#include <string.h>
+#include <vmalloc.h>
+
+
+#define MSR_GS_BASE		0xc0000101
+#define MSR_KERNEL_GS_BASE	0xc0000102
+
+/* Dynamic per-CPU memory is given out in units of this size. */
+#define PERCPU_UNIT	sizeof(unsigned long)
+#define PERCPU_UNITS	(PERCPU_CHUNK_SIZE / PERCPU_UNIT)
+#define PERCPU_BITS	(sizeof(unsigned long) * 8)
+#define PERCPU_WORDS	(PERCPU_UNITS / PERCPU_BITS)
+
+/**
+ * The first chunk is a part of the static area, so that per-CPU memory
+ * is available from the very beginning: e.g. buddy and slab statistics
+ * counters are set up before vmalloc and kmalloc work.
+ **/
+#define PERCPU_FIRST_SIZE	((size_t)1 << 14)
+#define PERCPU_FIRST_UNITS	(PERCPU_FIRST_SIZE / PERCPU_UNIT)
+
+
+/**
+ * This variable must go first in the area, so that this_cpu_offset reads
+ * it at GS:0 without knowing where the template is.
+ **/
+__attribute__((section(".percpu.first"))) uintptr_t percpu_this_offset;
+
+uintptr_t percpu_offset[NR_CPUS];
+
+/**
+ * Chunk bitmaps: alloc has a bit set for every busy unit and bound for
+ * the first unit of every allocation, so percpu_free knows where the
+ * allocation ends without storing its size.
+ **/
+struct percpu_chunk {
+	struct list_head ll;
+	char *base;
+	size_t units;
+	size_t free;
+	unsigned long alloc[PERCPU_WORDS];
+	unsigned long bound[PERCPU_WORDS];
+};
+
+static struct mutex percpu_mtx;
+static struct list_head percpu_chunks;
+
+static struct percpu_chunk percpu_first_chunk;
+static DEFINE_PER_CPU(unsigned long [PERCPU_FIRST_UNITS], percpu_first)
+			__attribute__((aligned (PAGE_SIZE)));
+
+
+static void wrmsr(uint32_t msr, uint64_t value)
+{
+	const uint32_t low = value;
+	const uint32_t high = value >> 32;
+
+	__asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
+
+static int percpu_test(const unsigned long *bitmap, size_t i)
+{
+	return (bitmap[i / PERCPU_BITS] >> (i % PERCPU_BITS)) & 1;
+}
+
+static void percpu_set(unsigned long *bitmap, size_t i, int set)
+{
+	const unsigned long bit = 1ul << (i % PERCPU_BITS);
+
+	if (set)
+		bitmap[i / PERCPU_BITS] |= bit;
+	else
+		bitmap[i / PERCPU_BITS] &= ~bit;
+}
+
+/* Returns the first free run of units aligned on align or PERCPU_UNITS. */
+static size_t percpu_find(const struct percpu_chunk *chunk, size_t units,
+			size_t align)
+{
+	for (size_t pos = 0; pos + units <= chunk->units; pos += align) {
+		size_t i = pos;
+
+		while (i != pos + units && !percpu_test(chunk->alloc, i))
+			++i;
+
+		if (i == pos + units)
+			return pos;
+	}
+	return PERCPU_UNITS;
+}
+
+static void percpu_chunk_init(struct percpu_chunk *chunk, void *base,
+			size_t units)
+{
+	chunk->base = base;
+	chunk->units = units;
+	chunk->free = units;
+	memset(chunk->alloc, 0, sizeof(chunk->alloc));
+	memset(chunk->bound, 0, sizeof(chunk->bound));
+	list_add_tail(&chunk->ll, &percpu_chunks);
+}
+
+/**
+ * With more CPUs copies of the chunk must be placed at percpu_offset
+ * from each other like copies of the static area, so far we have only
+ * the boot CPU and its copy is the chunk itself.
+ **/
+static struct percpu_chunk *percpu_chunk_create(void)
+{
+	struct percpu_chunk *chunk = kmalloc(sizeof(*chunk));
+
+	if (!chunk)
+		return 0;
+
+	void *base = vmalloc(PERCPU_CHUNK_SIZE);
+
+	if (!base) {
+		kfree(chunk);
+		return 0;
+	}
+
+	percpu_chunk_init(chunk, base, PERCPU_UNITS);
+	return chunk;
+}
+
+static void percpu_chunk_destroy(struct percpu_chunk *chunk)
+{
+	list_del(&chunk->ll);
+	vfree(chunk->base);
+	kfree(chunk);
+}
+
+void *percpu_alloc(size_t size, size_t align)
+{
+	const size_t units = (size + PERCPU_UNIT - 1) / PERCPU_UNIT;
+	const size_t ualign = align > PERCPU_UNIT ? align / PERCPU_UNIT : 1;
+
+	if (!units || size > PERCPU_CHUNK_SIZE)
+		return 0;
+
+	mutex_lock(&percpu_mtx);
+	struct percpu_chunk *chunk = 0;
+	size_t pos = PERCPU_UNITS;
+
+	for (struct list_head *ptr = percpu_chunks.next;
+				ptr != &percpu_chunks; ptr = ptr->next) {
+		struct percpu_chunk *cur = (struct percpu_chunk *)ptr;
+
+		if (cur->free < units)
+			continue;
+
+		pos = percpu_find(cur, units, ualign);
+		if (pos != PERCPU_UNITS) {
+			chunk = cur;
+			break;
+		}
+	}
+
+	if (!chunk) {
+		chunk = percpu_chunk_create();
+		pos = 0;
+	}
+
+	if (!chunk) {
+		mutex_unlock(&percpu_mtx);
+		return 0;
+	}
+
+	for (size_t i = pos; i != pos + units; ++i)
+		percpu_set(chunk->alloc, i, 1);
+	percpu_set(chunk->bound, pos, 1);
+	chunk->free -= units;
+	mutex_unlock(&percpu_mtx);
+
+	void *ptr = chunk->base + pos * PERCPU_UNIT;
+
+	for_each_cpu(cpu)
+		memset(per_cpu_ptr(ptr, cpu), 0, units * PERCPU_UNIT);
+	return ptr;
+}
+
+void percpu_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	mutex_lock(&percpu_mtx);
+	for (struct list_head *lst = percpu_chunks.next;
+				lst != &percpu_chunks; lst = lst->next) {
+		struct percpu_chunk *chunk = (struct percpu_chunk *)lst;
+		const char *addr = ptr;
+		const char *end = chunk->base + chunk->units * PERCPU_UNIT;
+
+		if (addr < chunk->base || addr >= end)
+			continue;
+
+		size_t i = (addr - chunk->base) / PERCPU_UNIT;
+
+		percpu_set(chunk->bound, i, 0);
+		do {
+			percpu_set(chunk->alloc, i++, 0);
+			++chunk->free;
+		} while (i != chunk->units && percpu_test(chunk->alloc, i) &&
+					!percpu_test(chunk->bound, i));
+
+		if (chunk->free == chunk->units && chunk != &percpu_first_chunk)
+			percpu_chunk_destroy(chunk);
+		break;
+	}
+	mutex_unlock(&percpu_mtx);
+}
+
+
+int percpu_counter_setup(struct percpu_counter *counter, long batch)
+{
+	spin_setup(&counter->lock);
+	counter->count = 0;
+	counter->batch = batch;
+	counter->counters = percpu_alloc(sizeof(long), sizeof(long));
+	return counter->counters ? 0 : -1;
+}
+
+void percpu_counter_release(struct percpu_counter *counter)
+{
+	percpu_free(counter->counters);
+	counter->counters = 0;
+}
+
+/**
+ * A single GS relative instruction, so we can't be interrupted or moved
+ * to another CPU in the middle and don't need to disable interrupts.
+ * GS base is percpu_begin plus the CPU offset, so offset of the counter
+ * from percpu_begin addresses the copy of the CPU (it wraps around for
+ * chunks below the template, and that's fine).
+ **/
+static void percpu_add(long *ptr, long delta)
+{
+	extern char percpu_begin[];
+	const uintptr_t offs = (uintptr_t)ptr - (uintptr_t)percpu_begin;
+
+	__asm__ volatile ("addq %1, %%gs:(%0)"
+				: : "r"(offs), "r"(delta) : "memory", "cc");
+}
+
+void percpu_counter_add(struct percpu_counter *counter, long delta)
+{
+	percpu_add(counter->counters, delta);
+
+	if (this_cpu_read(*counter->counters) < counter->batch &&
+			this_cpu_read(*counter->counters) > -counter->batch)
+		return;
+
+	const int enabled = spin_lock_int_save(&counter->lock);
+	long *count = this_cpu_ptr(counter->counters);
+
+	counter->count += *count;
+	*count = 0;
+	spin_unlock_int_restore(&counter->lock, enabled);
+}
+
+long percpu_counter_sum(struct percpu_counter *counter)
+{
+	const int enabled = spin_lock_int_save(&counter->lock);
+	long sum = counter->count;
+
+	for_each_cpu(cpu)
+		sum += *per_cpu_ptr(counter->counters, cpu);
+	spin_unlock_int_restore(&counter->lock, enabled);
+
+	return sum;
+}
+
+
+void percpu_setup(void)
+{
+	extern char percpu_begin[];
+
+	/**
+	 * Interrupt entry swaps GS bases when it comes from user mode (see
+	 * entry.S), so the kernel one is always active in the kernel.
+	 **/
+	wrmsr(MSR_GS_BASE, (uintptr_t)percpu_begin + percpu_offset[0]);
+	wrmsr(MSR_KERNEL_GS_BASE, 0);
+	per_cpu(percpu_this_offset, 0) = percpu_offset[0];
+
+	mutex_setup(&percpu_mtx);
+	list_init(&percpu_chunks);
+	percpu_chunk_init(&percpu_first_chunk, percpu_first,
+				PERCPU_FIRST_UNITS);
+}
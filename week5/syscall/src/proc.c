@@ -0,0 +1,36 @@
+#include <proc.h>
+
+#include <buddy.h>
+#include <compact.h>
+#include <print.h>
+#include <ramfs.h>
+#include <slab.h>
+
+
+struct proc_file {
+	const char *name;
+	void (*show)(struct file *file);
+};
+
+static const struct proc_file proc_files[] = {
+	{"proc/buddyinfo", &buddy_show},
+	{"proc/buddybench", &buddy_bench_show},
+	{"proc/compactinfo", &compact_show},
+	{"proc/slabinfo", &slab_show},
+	{"proc/slabbench", &slab_bench_show},
+};
+
+
+void proc_setup(void)
+{
+	const size_t count = sizeof(proc_files) / sizeof(proc_files[0]);
+
+	for (size_t i = 0; i != count; ++i) {
+		const struct proc_file *proc = &proc_files[i];
+
+		if (ramfs_create_show(proc->name, proc->show)) {
+			printf("failed to create %s\n", proc->name);
+			while (1);
+		}
+	}
+}
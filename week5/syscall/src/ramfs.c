@@ -3,9 +3,13 @@
 #include <buddy.h>
 #include <memory.h>
 #include <mutex.h>
+#include <print.h>
+#include <reclaim.h>
 #include <slab.h>
 #include <string.h>
 
+#include <stdarg.h>
+
 
 struct ramfs_page {
 	struct list_head ll;
@@ -18,6 +22,7 @@ static struct slab_cache ramfs_slab;
 static struct slab_cache page_slab;
 static struct list_head ramfs_cache;
 static struct mutex ramfs_mtx;
+static struct shrinker ramfs_shrinker;
 
 
 static int __ramfs_open(const char *name, int create, struct file **res)
@@ -30,6 +35,7 @@ static int __ramfs_open(const char *name, int create, struct file **res)
 		if (strcmp(name, file->name))
 			continue;
 
+		++file->refs;
 		*res = file;
 		return 0;
 	}
@@ -39,10 +45,10 @@ static int __ramfs_open(const char *name, int create, struct file **res)
 
 	struct file *new = slab_cache_alloc(&ramfs_slab);
 
-	new->size = 0;
 	strcpy(new->name, name);
 	list_add(&new->ll, head);
-	list_init(&new->data);
+	new->show = 0;
+	new->refs = 1;
 	*res = new;
 	return 0;
 }
@@ -57,24 +63,47 @@ int ramfs_create(const char *name, struct file **res)
 	return err;
 }
 
+static size_t __ramfs_truncate(struct file *file);
+
 int ramfs_open(const char *name, struct file **res)
 {
 	int err;
 
 	mutex_lock(&ramfs_mtx);
 	err = __ramfs_open(name, 0, res);
+	if (!err && (*res)->show) {
+		__ramfs_truncate(*res);
+		(*res)->show(*res);
+	}
+	mutex_unlock(&ramfs_mtx);
+	return err;
+}
+
+int ramfs_create_show(const char *name, void (*show)(struct file *))
+{
+	struct file *file;
+	int err;
+
+	mutex_lock(&ramfs_mtx);
+	err = __ramfs_open(name, 1, &file);
+	if (!err) {
+		file->show = show;
+		--file->refs;
+	}
 	mutex_unlock(&ramfs_mtx);
 	return err;
 }
 
 /**
- * We don't actually need to do anything on close because the filesystem
- * is very simplistic doesn't support deletes and read/write functions
- * are stateless.
+ * The filesystem is very simplistic, doesn't support deletes and read/write
+ * functions are stateless, so we only need to know if the file is open, so
+ * that we don't drop content of show files being read.
  **/
 void ramfs_close(struct file *file)
 {
-	(void) file;
+	mutex_lock(&ramfs_mtx);
+	--file->refs;
+	mutex_unlock(&ramfs_mtx);
 }
 
 
@@ -123,6 +152,13 @@ long ramfs_readat(struct file *file, void *data, long size, long offs)
 	return ret;
 }
 
+/**
+ * Data pages and their descriptors for a write are allocated in batches
+ * of this size, so a large write doesn't go into the buddy allocator and
+ * the slab cache for every page.
+ **/
+#define RAMFS_BULK_SIZE	16
+
 static long __ramfs_writeat(struct file *file, const char *data, long size,
 			long offs)
 {
@@ -130,6 +166,10 @@ static long __ramfs_writeat(struct file *file, const char *data, long size,
 	const long from = offs;
 	const long to = offs + size;
 
+	struct page *pages[RAMFS_BULK_SIZE];
+	void *descs[RAMFS_BULK_SIZE];
+	size_t count = 0, used = 0;
+
 	if (to > file->size)
 		file->size = to;
 
@@ -140,17 +180,28 @@ static long __ramfs_writeat(struct file *file, const char *data, long size,
 			continue;
 
 		if (ptr == head || rp->offs > offs) {
-			struct ramfs_page *new = slab_cache_alloc(&page_slab);
+			if (used == count) {
+				const long left = (to - (offs & ~(PAGE_SIZE - 1l))
+						+ PAGE_SIZE - 1) / PAGE_SIZE;
+
+				count = __buddy_alloc_bulk(0, BUDDY_ZERO,
+						left < RAMFS_BULK_SIZE
+						? left : RAMFS_BULK_SIZE,
+						pages);
+				used = slab_cache_alloc_bulk(&page_slab, count,
+							descs);
+				__buddy_free_bulk(0, count - used,
+							pages + used);
+				count = used;
+				used = 0;
+			}
 
-			if (!new)
-				return offs == from ? -1 : offs - from;
+			if (used == count)
+				break;
 
-			new->page = __buddy_alloc(0);
-			if (!new->page) {
-				slab_cache_free(&page_slab, new);
-				return offs == from ? -1 : offs - from;	
-			}
+			struct ramfs_page *new = descs[used];
 
+			new->page = pages[used++];
 			/* all offsets must be PAGE_SIZE aligned */
 			new->offs = offs & ~(PAGE_SIZE - 1l);
 			list_add_before(&new->ll, ptr);
@@ -171,6 +222,13 @@ static long __ramfs_writeat(struct file *file, const char *data, long size,
 		memcpy(page + page_offs, data + data_offs, to_copy);
 		offs += to_copy;
 	}
+
+	/* Some of the pages might be unused if parts of file already exist. */
+	__buddy_free_bulk(0, count - used, pages + used);
+	slab_cache_free_bulk(&page_slab, count - used, descs + used);
+
+	if (offs != to && offs == from)
+		return -1;
 	return offs - from;
 }
 
@@ -184,10 +242,104 @@ long ramfs_writeat(struct file *file, const void *data, long size, long offs)
 	return ret;
 }
 
+/* Returns number of pages freed. */
+static size_t __ramfs_truncate(struct file *file)
+{
+	struct list_head *head = &file->data;
+	struct page *pages[RAMFS_BULK_SIZE];
+	void *descs[RAMFS_BULK_SIZE];
+	size_t count = 0;
+	size_t freed = 0;
+
+	while (!list_empty(head)) {
+		struct ramfs_page *rp = (struct ramfs_page *)head->next;
+
+		if (count == RAMFS_BULK_SIZE) {
+			__buddy_free_bulk(0, count, pages);
+			slab_cache_free_bulk(&page_slab, count, descs);
+			count = 0;
+		}
+		list_del(&rp->ll);
+		pages[count] = rp->page;
+		descs[count++] = rp;
+		++freed;
+	}
+	__buddy_free_bulk(0, count, pages);
+	slab_cache_free_bulk(&page_slab, count, descs);
+	file->size = 0;
+	return freed;
+}
+
+/* Longer lines are truncated. */
+#define RAMFS_PRINTF_MAX	256
+
+/* Must be called with ramfs_mtx held (i.e. from show) unless file is 0. */
+int ramfs_printf(struct file *file, const char *fmt, ...)
+{
+	char buf[RAMFS_PRINTF_MAX];
+	va_list args;
+	int rc;
+
+	va_start(args, fmt);
+	if (!file) {
+		rc = vprintf(fmt, args);
+		va_end(args);
+		return rc;
+	}
+	rc = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (rc <= 0)
+		return rc;
+	if (rc >= (int)sizeof(buf))
+		rc = sizeof(buf) - 1;
+	return (int)__ramfs_writeat(file, buf, rc, file->size);
+}
+
+/**
+ * Content of show files is regenerated on every open anyway, so we drop
+ * it when the file is not open.
+ **/
+static size_t ramfs_shrink(struct shrinker *shrinker, size_t pages)
+{
+	struct list_head *head = &ramfs_cache;
+	size_t freed = 0;
+
+	(void) shrinker;
+
+	/* We might be called while ramfs itself allocates memory. */
+	if (!mutex_trylock(&ramfs_mtx))
+		return 0;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct file *file = (struct file *)ptr;
+
+		if (!file->show || file->refs)
+			continue;
+
+		freed += __ramfs_truncate(file);
+		if (freed >= pages)
+			break;
+	}
+	mutex_unlock(&ramfs_mtx);
+	return freed;
+}
+
+static void ramfs_file_ctor(void *ptr)
+{
+	struct file *file = ptr;
+
+	file->size = 0;
+	list_init(&file->data);
+}
+
 void ramfs_setup(void)
 {
-	slab_cache_setup(&ramfs_slab, sizeof(struct file));
-	slab_cache_setup(&page_slab, sizeof(struct ramfs_page));
+	__slab_cache_setup(&ramfs_slab, "ramfs_file", sizeof(struct file),
+				SLAB_DEFAULT_ALIGN, &ramfs_file_ctor, 0, 0);
+	slab_cache_setup(&page_slab, "ramfs_page", sizeof(struct ramfs_page));
 	mutex_setup(&ramfs_mtx);
 	list_init(&ramfs_cache);
+	ramfs_shrinker.shrink = &ramfs_shrink;
+	shrinker_register(&ramfs_shrinker);
 }
@@ -0,0 +1,105 @@
+#include <reclaim.h>
+#include <buddy.h>
+#include <condition.h>
+#include <lock.h>
+#include <print.h>
+#include <threads.h>
+
+
+/**
+ * Shrinkers register while their subsystems are set up, some of them
+ * before reclaim_setup, so the list is initialized statically.
+ **/
+static struct list_head shrinkers = {&shrinkers, &shrinkers};
+static struct spinlock shrinker_lock;
+
+static struct spinlock reclaim_lock;
+static struct condition reclaim_cv;
+static struct thread *kreclaimd_thread;
+static int kreclaimd_pending;
+
+
+void shrinker_register(struct shrinker *shrinker)
+{
+	spin_lock(&shrinker_lock);
+	list_add_tail(&shrinker->ll, &shrinkers);
+	spin_unlock(&shrinker_lock);
+}
+
+void shrinker_unregister(struct shrinker *shrinker)
+{
+	spin_lock(&shrinker_lock);
+	list_del(&shrinker->ll);
+	spin_unlock(&shrinker_lock);
+}
+
+size_t reclaim_pages(size_t pages)
+{
+	struct list_head *head = &shrinkers;
+	size_t freed = 0;
+
+	spin_lock(&shrinker_lock);
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct shrinker *shrinker = (struct shrinker *)ptr;
+
+		freed += shrinker->shrink(shrinker, pages - freed);
+		if (freed >= pages)
+			break;
+	}
+	spin_unlock(&shrinker_lock);
+	return freed;
+}
+
+void reclaim_wakeup(void)
+{
+	if (!kreclaimd_thread || !buddy_watermark_deficit(WMARK_LOW))
+		return;
+
+	const int enabled = spin_lock_int_save(&reclaim_lock);
+
+	if (!kreclaimd_pending) {
+		kreclaimd_pending = 1;
+		notify_one(&reclaim_cv);
+	}
+	spin_unlock_int_restore(&reclaim_lock, enabled);
+}
+
+
+static int kreclaimd(void *unused)
+{
+	(void) unused;
+
+	while (1) {
+		const int enabled = spin_lock_int_save(&reclaim_lock);
+
+		while (!kreclaimd_pending)
+			condition_wait_spin_int(&reclaim_cv, &reclaim_lock);
+		kreclaimd_pending = 0;
+		spin_unlock_int_restore(&reclaim_lock, enabled);
+
+		/* Stop if there is nothing left to reclaim. */
+		size_t deficit;
+
+		while ((deficit = buddy_watermark_deficit(WMARK_HIGH)) &&
+					reclaim_pages(deficit))
+			schedule();
+	}
+	return 0;
+}
+
+void reclaim_setup(void)
+{
+	spin_setup(&shrinker_lock);
+	spin_setup(&reclaim_lock);
+	condition_setup(&reclaim_cv);
+
+	struct thread *thread = thread_create(&kreclaimd, 0);
+
+	if (!thread) {
+		printf("Failed to create reclaim thread\n");
+		while (1);
+	}
+
+	thread_start(thread);
+	kreclaimd_thread = thread;
+}
@@ -1,6 +1,14 @@
 #include <slab.h>
 #include <buddy.h>
+#include <condition.h>
+#include <ints.h>
 #include <print.h>
+#include <ramfs.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include <stddef.h>
 
 
 struct list {
@@ -9,62 +17,263 @@ struct list {
 
 struct slab {
 	struct list_head ll;
+	struct slab_cache *cache;
 	struct page *page;
 	struct list *free;
 	size_t size;
+	char *objs;
 };
 
 
+/**
+ * Magazines (see Bonwick and Adams, "Magazines and Vmem") are stacks of
+ * free objects. The CPU keeps two of them (loaded and previous), so most
+ * of allocations and frees just pop or push an object with interrupts
+ * disabled, without taking the cache lock and touching slab lists. Only
+ * when both are empty (or full) we go to the depot under the cache lock
+ * to exchange one of them for a full (or empty) magazine.
+ *
+ * Magazines are allocated from their own caches (without magazines),
+ * a magazine of class i takes SLAB_MAG_MIN_BYTES << i bytes.
+ **/
+struct slab_magazine {
+	struct list_head ll;
+	int rounds;
+	int class;
+	void *round[];
+};
+
+#define SLAB_MAG_CLASSES	5
+#define SLAB_MAG_MIN_BYTES	64
+
+static struct slab_cache slab_magazine_cache[SLAB_MAG_CLASSES];
+static const char *const slab_magazine_names[SLAB_MAG_CLASSES] = {
+	"magazine-64", "magazine-128", "magazine-256", "magazine-512",
+	"magazine-1024"
+};
+
+/**
+ * Magazines start small and grow when the depot gets busy: if the depot
+ * was visited SLAB_MAG_CONTENDED times in a window of SLAB_MAG_WINDOW
+ * operations, the magazines are too small for the workload. With only
+ * one CPU there is no real lock contention, so the depot traffic is the
+ * best measure we have.
+ **/
+#define SLAB_MAG_WINDOW		1024
+#define SLAB_MAG_CONTENDED	32
+
+/**
+ * Without colouring the first objects of all slabs (usually the hottest
+ * ones) start at the same offset and compete for the same cache sets.
+ * So every new slab shifts objects by the next multiple of the cache
+ * line size, as long as the bytes left unused in the slab allow.
+ **/
+#define SLAB_CACHE_LINE		64
+
+/**
+ * Slab order is the smallest one that fits at least SLAB_MIN_OBJECTS
+ * objects and wastes no more than 1/SLAB_WASTE_RATIO of the slab, but we
+ * don't go above SLAB_MAX_ORDER unless a single object doesn't fit there,
+ * large slabs are hard to allocate. Descriptors of slabs of objects of
+ * SLAB_OFF_SLAB_SIZE or more are allocated separately (off-slab), so
+ * that e.g. 4KB objects fill the whole pages.
+ **/
+#define SLAB_MIN_OBJECTS	8
+#define SLAB_WASTE_RATIO	8
+#define SLAB_MAX_ORDER		3
+#define SLAB_OFF_SLAB_SIZE	(PAGE_SIZE / 8)
+
+static struct slab_cache slab_meta_cache;
+
+/* Lockless mode needs cmpxchg16b, see slab_setup. */
+static int slab_lockless_supported;
+
+
+/**
+ * General purpose allocations (kmalloc) of up to 2^KMALLOC_MAX_SHIFT bytes
+ * are served by caches of power of two sizes starting at 2^KMALLOC_MIN_SHIFT
+ * bytes, larger ones go to the buddy allocator directly.
+ **/
+#define KMALLOC_MIN_SHIFT	3
+#define KMALLOC_MAX_SHIFT	13
+#define KMALLOC_CACHES		(KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static struct slab_cache kmalloc_cache[KMALLOC_CACHES];
+static const char *const kmalloc_names[KMALLOC_CACHES] = {
+	"kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64",
+	"kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+	"kmalloc-2048", "kmalloc-4096", "kmalloc-8192"
+};
+
+
+/**
+ * Caches keep a few empty slabs for the next allocations, but once the
+ * load goes down there is no point to keep them all until the memory
+ * pressure: every SLAB_REAP_TICKS timer ticks the reaper thread destroys
+ * empty slabs of every cache above its reap_keep (SLAB_REAP_KEEP by
+ * default). Registry of all caches is initialized statically, because
+ * caches are set up before slab_setup returns.
+ **/
+#define SLAB_REAP_TICKS		32
+#define SLAB_REAP_KEEP		2
+
+static struct list_head slab_caches = {&slab_caches, &slab_caches};
+static struct spinlock slab_caches_lock;
+
+static struct timer slab_reap_timer;
+static struct spinlock slab_reap_lock;
+static struct condition slab_reap_cv;
+static int slab_reap_pending;
+
+
+/**
+ * Pages of slabs and large kmalloc allocations are busy, so we can use
+ * their private data to find what an object belongs to: it points to the
+ * slab descriptor or keeps (order << 1) | 1 for a large kmalloc
+ * allocation, descriptors are aligned so the lowest bit tells them apart.
+ **/
+static void slab_page_set(struct page *page, int order, uintptr_t data)
+{
+	for (size_t i = 0; i != (size_t)1 << order; ++i)
+		page_set_private(&page[i], data);
+}
+
+static struct slab *slab_page_slab(const struct page *page)
+{
+	const uintptr_t data = page_private(page);
+
+	return (data & 1) ? 0 : (struct slab *)data;
+}
+
+static struct slab_cache *slab_page_cache(const struct page *page)
+{
+	const struct slab *slab = slab_page_slab(page);
+
+	return slab ? slab->cache : 0;
+}
+
+static int slab_page_order(const struct page *page)
+{
+	return (int)(page_private(page) >> 1);
+}
+
+
 static struct slab *slab_get_meta(struct slab_cache *cache, void *virt)
 {
 	const size_t bytes = (size_t)PAGE_SIZE << cache->slab_order;
 
+	if (cache->off_slab)
+		return slab_cache_alloc(&slab_meta_cache);
 	return (struct slab *)((char *)virt + bytes - sizeof(struct slab));
 }
 
+/**
+ * Slabs with free objects go to the partial list, slabs without busy
+ * objects go to the empty list. These must be called with the cache lock
+ * held and keep the per list counters.
+ **/
+static unsigned long *slab_list_count(struct slab_cache *cache,
+			const struct slab *slab)
+{
+	if (!slab->size)
+		return &cache->stats.full;
+	if (slab->size == cache->slab_size)
+		return &cache->stats.empty;
+	return &cache->stats.partial;
+}
+
+static void slab_list_add(struct slab_cache *cache, struct slab *slab)
+{
+	unsigned long *count = slab_list_count(cache, slab);
+
+	if (count == &cache->stats.full)
+		list_add(&slab->ll, &cache->full);
+	else if (count == &cache->stats.empty)
+		list_add(&slab->ll, &cache->empty);
+	else
+		list_add(&slab->ll, &cache->partial);
+	++*count;
+}
+
+static void slab_list_del(struct slab_cache *cache, struct slab *slab)
+{
+	list_del(&slab->ll);
+	--*slab_list_count(cache, slab);
+}
+
+/**
+ * Must be called with the cache lock held. The lock is dropped while we
+ * allocate memory: allocation might call shrinkers, and the shrinker of
+ * this very cache takes the lock and changes the slab lists, so callers
+ * must not keep anything taken from the lists across the call.
+ **/
 static struct slab *slab_create(struct slab_cache *cache)
 {
-	struct page *page = __buddy_alloc(cache->slab_order);
+	spin_unlock(&cache->lock);
 
-	if (!page)
+	struct page *page = __buddy_alloc(cache->slab_order, 0);
+	char *ptr = page ? va(page_addr(page)) : 0;
+	struct slab *slab = ptr ? slab_get_meta(cache, ptr) : 0;
+
+	if (page && !slab)
+		__buddy_free(page, cache->slab_order);
+	spin_lock(&cache->lock);
+
+	if (!slab)
 		return 0;
 
-	const uintptr_t phys = page_addr(page);
-	char *ptr = va(phys);
-	struct slab *slab = slab_get_meta(cache, ptr);
 	struct list *head = 0;
 
+	slab_page_set(page, cache->slab_order, (uintptr_t)slab);
+
+	ptr += cache->colour_next * cache->colour_step;
+	if (++cache->colour_next == cache->colours)
+		cache->colour_next = 0;
+
+	slab->cache = cache;
 	slab->page = page;
 	slab->size = cache->slab_size;
+	slab->objs = ptr;
 
 	for (size_t i = 0; i != slab->size; ++i, ptr += cache->obj_size) {
-		struct list *node = (struct list *)ptr;
+		struct list *node = (struct list *)(ptr + cache->link_offs);
 
+		if (cache->ctor)
+			cache->ctor(ptr);
 		node->next = head;
 		head = node;
 	}
 	slab->free = head;
+	++cache->stats.created;
 	return slab;
 }
 
 static void slab_destroy(struct slab_cache *cache, struct slab *slab)
 {
+	if (cache->dtor) {
+		char *ptr = slab->objs;
+
+		for (size_t i = 0; i != cache->slab_size;
+					++i, ptr += cache->obj_size)
+			cache->dtor(ptr);
+	}
 	__buddy_free(slab->page, cache->slab_order);
+	if (cache->off_slab)
+		slab_cache_free(&slab_meta_cache, slab);
 }
 
-static void *slab_alloc(struct slab *slab)
+static void *slab_alloc(struct slab_cache *cache, struct slab *slab)
 {
 	struct list *head = slab->free;
-	void *ptr = head;
 
 	slab->free = head->next;
 	--slab->size;
-	return ptr;
+	return (char *)head - cache->link_offs;
 }
 
-static void slab_free(struct slab *slab, void *ptr)
+static void slab_free(struct slab_cache *cache, struct slab *slab, void *ptr)
 {
-	struct list *head = ptr;
+	struct list *head = (struct list *)((char *)ptr + cache->link_offs);
 
 	head->next = slab->free;
 	slab->free = head;
@@ -82,8 +291,31 @@ static size_t slab_align_up(size_t x, size_t align)
 	return slab_align_down(x + align - 1, align);
 }
 
-void __slab_cache_setup(struct slab_cache *cache, size_t size, size_t align)
+static size_t slab_cache_shrinker(struct shrinker *shrinker, size_t pages)
 {
+	struct slab_cache *cache = (struct slab_cache *)((char *)shrinker -
+				offsetof(struct slab_cache, shrinker));
+
+	(void) pages;
+	return slab_cache_shrink(cache);
+}
+
+static void slab_cache_init(struct slab_cache *cache, const char *name,
+			size_t size, size_t align, void (*ctor)(void *),
+			void (*dtor)(void *), unsigned flags)
+{
+	size_t link_offs = 0;
+
+	/**
+	 * Free objects are linked through their first bytes, but that would
+	 * break the constructed state, so in this case we put the link right
+	 * after the object.
+	 **/
+	if (ctor) {
+		link_offs = slab_align_up(size, sizeof(struct list *));
+		size = link_offs + sizeof(struct list);
+	}
+
 	if (size < sizeof(struct list))
 		size = sizeof(struct list);
 
@@ -94,24 +326,36 @@ void __slab_cache_setup(struct slab_cache *cache, size_t size, size_t align)
 	}
 
 	const size_t obj_size = slab_align_up(size, align);
+	const int off_slab = obj_size >= SLAB_OFF_SLAB_SIZE;
+	const size_t meta = off_slab ? 0 : sizeof(struct slab);
 
-	/**
-	 * We select slab_order so that amortized allocation time will be O(1).
-	 * Since we use buddy allocator to allocate slabs which works in
-	 * O(MAX_ORDER) time (plus time required to check a zone), one slab
-	 * should consist of at least MAX_ORDER objects;
-	 **/
-	size_t bytes;
+	/* See SLAB_MAX_ORDER and friends for how we select slab_order. */
+	size_t bytes, slab_size;
 	int slab_order;
 
-	for (slab_order = 0; slab_order <= MAX_ORDER; ++slab_order) {
-		bytes = ((size_t)PAGE_SIZE << slab_order) - sizeof(struct slab);
-		if (bytes / obj_size >= MAX_ORDER)
+	for (slab_order = 0; slab_order != MAX_ORDER; ++slab_order) {
+		bytes = ((size_t)PAGE_SIZE << slab_order) - meta;
+		slab_size = bytes / obj_size;
+
+		if (!slab_size)
+			continue;
+		if (slab_order >= SLAB_MAX_ORDER)
+			break;
+		if (slab_size >= SLAB_MIN_OBJECTS &&
+				(bytes - slab_size * obj_size)
+					* SLAB_WASTE_RATIO <= bytes)
 			break;
 	}
 
-	const size_t slab_size = bytes / obj_size;
+	bytes = ((size_t)PAGE_SIZE << slab_order) - meta;
+	slab_size = bytes / obj_size;
+	const size_t colour_step = slab_align_up(SLAB_CACHE_LINE, align);
+
+	if ((flags & SLAB_LOCKLESS) && !slab_lockless_supported)
+		flags &= ~SLAB_LOCKLESS;
 
+	cache->name = name;
+	cache->flags = flags;
 	spin_setup(&cache->lock);
 
 	list_init(&cache->full);
@@ -121,34 +365,107 @@ void __slab_cache_setup(struct slab_cache *cache, size_t size, size_t align)
 	cache->slab_order = slab_order;
 	cache->slab_size = slab_size;
 	cache->obj_size = obj_size;
+	cache->off_slab = off_slab;
+	cache->link_offs = link_offs;
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+
+	cache->colour_step = colour_step;
+	cache->colours = (bytes - slab_size * obj_size) / colour_step + 1;
+	cache->colour_next = 0;
+
+	cache->cpu.loaded = 0;
+	cache->cpu.previous = 0;
+	cache->cpu.alloc_hits = 0;
+	cache->cpu.alloc_misses = 0;
+	cache->cpu.free_hits = 0;
+	cache->cpu.free_misses = 0;
+	cache->cpu.freelist.head = 0;
+	cache->cpu.freelist.tid = 0;
+	cache->cpu.slab = 0;
+
+	list_init(&cache->depot.full);
+	list_init(&cache->depot.empty);
+	cache->depot.mag_class =
+			(flags & (SLAB_NOMAGAZINE | SLAB_LOCKLESS)) ? -1 : 0;
+	cache->depot.window = 0;
+	cache->depot.visits = 0;
+
+	cache->shrinker.shrink = &slab_cache_shrinker;
+	shrinker_register(&cache->shrinker);
+	cache->reap_keep = SLAB_REAP_KEEP;
+
+	if (percpu_counter_setup(&cache->stats.allocs, PERCPU_COUNTER_BATCH)
+			|| percpu_counter_setup(&cache->stats.frees,
+					PERCPU_COUNTER_BATCH)) {
+		printf("Failed to allocate slab cache statistics\n");
+		while (1);
+	}
+	cache->stats.created = 0;
+	cache->stats.destroyed = 0;
+	cache->stats.full = 0;
+	cache->stats.partial = 0;
+	cache->stats.empty = 0;
+
+	spin_lock(&slab_caches_lock);
+	list_add_tail(&cache->link, &slab_caches);
+	spin_unlock(&slab_caches_lock);
 }
 
-void slab_cache_setup(struct slab_cache *cache, size_t size)
+void __slab_cache_setup(struct slab_cache *cache, const char *name,
+			size_t size, size_t align, void (*ctor)(void *),
+			void (*dtor)(void *), unsigned flags)
 {
-	const size_t DEFAULT_ALIGN = 8;
+	slab_cache_init(cache, name, size, align, ctor, dtor, flags);
+}
 
-	__slab_cache_setup(cache, size, DEFAULT_ALIGN);
+void slab_cache_setup(struct slab_cache *cache, const char *name, size_t size)
+{
+	__slab_cache_setup(cache, name, size, SLAB_DEFAULT_ALIGN, 0, 0, 0);
 }
 
+static void slab_cache_flush(struct slab_cache *cache);
+
 void slab_cache_release(struct slab_cache *cache)
 {
+	spin_lock(&slab_caches_lock);
+	list_del(&cache->link);
+	spin_unlock(&slab_caches_lock);
+
+	slab_cache_flush(cache);
 	if (!list_empty(&cache->full) || !list_empty(&cache->partial)) {
 		printf("Slab cache still contains busy objects\n");
 		while (1);
 	}
+	shrinker_unregister(&cache->shrinker);
 	slab_cache_shrink(cache);
+	percpu_counter_release(&cache->stats.allocs);
+	percpu_counter_release(&cache->stats.frees);
 }
 
 
-void slab_cache_shrink(struct slab_cache *cache)
+/**
+ * Destroys empty slabs above keep, starting from the ones that became
+ * empty first, returns number of pages freed.
+ **/
+static size_t slab_cache_trim(struct slab_cache *cache, size_t keep)
 {
 	struct list_head list;
 	struct list_head *head = &list;
+	size_t slabs = 0;
+
+	list_init(&list);
 
 	const int enabled = spin_lock_int_save(&cache->lock);
 
-	list_init(&list);
-	list_splice(&cache->empty, &list);
+	while (cache->stats.empty > keep) {
+		struct slab *slab = (struct slab *)cache->empty.prev;
+
+		slab_list_del(cache, slab);
+		list_add(&slab->ll, &list);
+		++slabs;
+	}
+	cache->stats.destroyed += slabs;
 	spin_unlock_int_restore(&cache->lock, enabled);
 
 	for (struct list_head *ptr = head->next; ptr != head;) {
@@ -157,62 +474,871 @@ void slab_cache_shrink(struct slab_cache *cache)
 		ptr = ptr->next;
 		slab_destroy(cache, slab);
 	}
+	return slabs << cache->slab_order;
 }
 
-static void *__slab_cache_alloc(struct slab_cache *cache)
+size_t slab_cache_shrink(struct slab_cache *cache)
+{
+	/* Objects in magazines keep their slabs busy. */
+	slab_cache_flush(cache);
+	return slab_cache_trim(cache, 0);
+}
+
+/* Takes a slab with free objects off the lists or creates a new one. */
+static struct slab *slab_cache_get_slab(struct slab_cache *cache)
 {
-	struct slab *slab = 0;
+	struct slab *slab;
 
 	if (!list_empty(&cache->partial)) {
 		slab = (struct slab *)cache->partial.next;
-		list_del(&slab->ll);
+		slab_list_del(cache, slab);
 	} else if (!list_empty(&cache->empty)) {
 		slab = (struct slab *)cache->empty.next;
-		list_del(&slab->ll);
+		slab_list_del(cache, slab);
 	} else {
 		slab = slab_create(cache);
+	}
+	return slab;
+}
+
+/* Takes as many objects as possible from a slab before going to the next. */
+static size_t __slab_cache_alloc_bulk(struct slab_cache *cache, size_t count,
+			void **ptrs)
+{
+	size_t got = 0;
+
+	while (got != count) {
+		struct slab *slab = slab_cache_get_slab(cache);
+
 		if (!slab)
-			return 0;
+			break;
+
+		while (got != count && slab->size)
+			ptrs[got++] = slab_alloc(cache, slab);
+
+		slab_list_add(cache, slab);
 	}
+	return got;
+}
+
+static void *__slab_cache_alloc(struct slab_cache *cache)
+{
+	void *ptr;
 
-	void *ptr = slab_alloc(slab);
+	return __slab_cache_alloc_bulk(cache, 1, &ptr) ? ptr : 0;
+}
 
-	if (slab->size)
-		list_add(&slab->ll, &cache->partial);
+
+static void __slab_cache_free(struct slab_cache *cache, void *ptr)
+{
+	struct slab *slab = slab_page_slab(addr_page(pa(ptr)));
+
+	slab_list_del(cache, slab);
+	slab_free(cache, slab, ptr);
+	slab_list_add(cache, slab);
+}
+
+
+
+static int slab_magazine_size(int class)
+{
+	const size_t bytes = (size_t)SLAB_MAG_MIN_BYTES << class;
+
+	return (bytes - sizeof(struct slab_magazine)) / sizeof(void *);
+}
+
+static struct slab_magazine *slab_magazine_alloc(int class)
+{
+	struct slab_magazine *mag =
+				slab_cache_alloc(&slab_magazine_cache[class]);
+
+	if (!mag)
+		return 0;
+
+	mag->rounds = 0;
+	mag->class = class;
+	return mag;
+}
+
+static void slab_magazine_free(struct slab_magazine *mag)
+{
+	slab_cache_free(&slab_magazine_cache[mag->class], mag);
+}
+
+static int slab_magazine_full(const struct slab_magazine *mag)
+{
+	return mag->rounds == slab_magazine_size(mag->class);
+}
+
+/* Both depot routines must be called with the cache lock held. */
+static void slab_depot_put(struct slab_cache *cache, struct slab_magazine *mag)
+{
+	struct slab_depot *depot = &cache->depot;
+
+	if (mag->rounds) {
+		list_add(&mag->ll, &depot->full);
+		return;
+	}
+
+	/* Empty magazines of the old size are not needed after a resize. */
+	if (mag->class != depot->mag_class)
+		slab_magazine_free(mag);
 	else
-		list_add(&slab->ll, &cache->full);
+		list_add(&mag->ll, &depot->empty);
+}
+
+static void slab_depot_visit(struct slab_cache *cache)
+{
+	struct slab_depot *depot = &cache->depot;
+	const struct slab_cpu *cpu = &cache->cpu;
+	const unsigned long ops = cpu->alloc_hits + cpu->alloc_misses +
+				cpu->free_hits + cpu->free_misses;
+
+	if (ops - depot->window > SLAB_MAG_WINDOW) {
+		depot->window = ops;
+		depot->visits = 0;
+	}
+
+	if (++depot->visits < SLAB_MAG_CONTENDED ||
+			depot->mag_class == SLAB_MAG_CLASSES - 1)
+		return;
+
+	++depot->mag_class;
+	depot->window = ops;
+	depot->visits = 0;
+
+	while (!list_empty(&depot->empty)) {
+		struct slab_magazine *mag =
+				(struct slab_magazine *)depot->empty.next;
+
+		list_del(&mag->ll);
+		slab_magazine_free(mag);
+	}
+}
+
+static void slab_cpu_swap(struct slab_cpu *cpu)
+{
+	struct slab_magazine *mag = cpu->loaded;
+
+	cpu->loaded = cpu->previous;
+	cpu->previous = mag;
+}
+
+/* Both CPU layer routines must be called with interrupts disabled. */
+static void *slab_cpu_alloc(struct slab_cache *cache)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+
+	if (!cpu->loaded || !cpu->loaded->rounds) {
+		if (cpu->previous && cpu->previous->rounds) {
+			slab_cpu_swap(cpu);
+		} else {
+			struct slab_depot *depot = &cache->depot;
+			struct slab_magazine *full = 0;
+
+			spin_lock(&cache->lock);
+			if (!list_empty(&depot->full)) {
+				full = (struct slab_magazine *)depot->full.next;
+				list_del(&full->ll);
+				if (cpu->previous)
+					slab_depot_put(cache, cpu->previous);
+				cpu->previous = cpu->loaded;
+				cpu->loaded = full;
+			}
+			slab_depot_visit(cache);
+			spin_unlock(&cache->lock);
+
+			if (!full) {
+				++cpu->alloc_misses;
+				return 0;
+			}
+		}
+	}
+
+	++cpu->alloc_hits;
+	return cpu->loaded->round[--cpu->loaded->rounds];
+}
+
+static int slab_cpu_free(struct slab_cache *cache, void *ptr)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+
+	if (!cpu->loaded || slab_magazine_full(cpu->loaded)) {
+		if (cpu->previous && !cpu->previous->rounds) {
+			slab_cpu_swap(cpu);
+		} else {
+			struct slab_depot *depot = &cache->depot;
+			struct slab_magazine *empty = 0;
+
+			spin_lock(&cache->lock);
+			if (!list_empty(&depot->empty)) {
+				empty = (struct slab_magazine *)
+							depot->empty.next;
+				list_del(&empty->ll);
+			}
+			spin_unlock(&cache->lock);
+
+			if (!empty)
+				empty = slab_magazine_alloc(depot->mag_class);
+
+			if (!empty) {
+				++cpu->free_misses;
+				return 0;
+			}
+
+			spin_lock(&cache->lock);
+			if (cpu->previous)
+				slab_depot_put(cache, cpu->previous);
+			cpu->previous = cpu->loaded;
+			cpu->loaded = empty;
+			slab_depot_visit(cache);
+			spin_unlock(&cache->lock);
+		}
+	}
+
+	++cpu->free_hits;
+	cpu->loaded->round[cpu->loaded->rounds++] = ptr;
+	return 1;
+}
+
+/**
+ * Lockless mode (see Lameter, "SLUB: The unqueued slab allocator"): the
+ * CPU takes a slab off the lists (freezes it) and moves all its free
+ * objects to the CPU freelist. Allocations from the CPU freelist and frees
+ * of objects of the CPU slab are a single cmpxchg16b of the head and the
+ * transaction id, without the lock and with interrupts enabled. Everything
+ * else (refills, frees of other slabs) goes the slow way with interrupts
+ * disabled and the cache lock held, and changes the id as well, so that
+ * the fast path interrupted in the middle notices the change and retries.
+ **/
+static int slab_cpu_cmpxchg(struct slab_cpu_freelist *freelist,
+			void *head, unsigned long tid, void *next)
+{
+	char done;
+
+	__asm__ volatile ("lock cmpxchg16b %1; setz %0"
+				: "=q"(done), "+m"(*freelist),
+				  "+a"(head), "+d"(tid)
+				: "b"(next), "c"(tid + 1)
+				: "memory", "cc");
+	return done;
+}
+
+static unsigned long slab_cpu_tid(const struct slab_cpu *cpu)
+{
+	const unsigned long tid =
+			*(const volatile unsigned long *)&cpu->freelist.tid;
+
+	/* the head and the slab must be read after the id */
+	__asm__ volatile ("" : : : "memory");
+	return tid;
+}
+
+static struct list *slab_cpu_head(const struct slab_cpu *cpu)
+{
+	return *(void *const volatile *)&cpu->freelist.head;
+}
+
+/**
+ * Slow path routines must be called with interrupts disabled and the
+ * cache lock held.
+ **/
+static void slab_cpu_deactivate(struct slab_cache *cache)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	struct slab *slab = cpu->slab;
+	struct list *head = cpu->freelist.head;
+
+	if (!slab)
+		return;
+
+	while (head) {
+		struct list *next = head->next;
+
+		slab_free(cache, slab, (char *)head - cache->link_offs);
+		head = next;
+	}
+	slab_list_add(cache, slab);
+	cpu->slab = 0;
+	cpu->freelist.head = 0;
+	++cpu->freelist.tid;
+}
+
+static void *slab_cpu_pop(struct slab_cache *cache)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	struct list *head = cpu->freelist.head;
+
+	if (!head) {
+		struct slab *slab;
+
+		slab_cpu_deactivate(cache);
+		slab = slab_cache_get_slab(cache);
+		if (!slab)
+			return 0;
+
+		cpu->slab = slab;
+		head = slab->free;
+		slab->free = 0;
+		slab->size = 0;
+	}
+
+	cpu->freelist.head = head->next;
+	++cpu->freelist.tid;
+	return (char *)head - cache->link_offs;
+}
+
+static void slab_cpu_push(struct slab_cache *cache, void *ptr)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	struct slab *slab = slab_page_slab(addr_page(pa(ptr)));
+	struct list *node = (struct list *)((char *)ptr + cache->link_offs);
+
+	if (slab != cpu->slab) {
+		__slab_cache_free(cache, ptr);
+		return;
+	}
+
+	node->next = cpu->freelist.head;
+	cpu->freelist.head = node;
+	++cpu->freelist.tid;
+}
+
+static void *slab_lockless_alloc(struct slab_cache *cache)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+
+	while (1) {
+		const unsigned long tid = slab_cpu_tid(cpu);
+		struct list *head = slab_cpu_head(cpu);
+
+		if (!head)
+			break;
+
+		/**
+		 * The object might be taken and even reused by an interrupt
+		 * right now, so next can be garbage, but then the id has
+		 * changed and cmpxchg fails.
+		 **/
+		if (slab_cpu_cmpxchg(&cpu->freelist, head, tid, head->next)) {
+			percpu_counter_inc(&cache->stats.allocs);
+			return (char *)head - cache->link_offs;
+		}
+	}
+
+	const int enabled = spin_lock_int_save(&cache->lock);
+	void *ptr = slab_cpu_pop(cache);
+
+	if (ptr)
+		percpu_counter_inc(&cache->stats.allocs);
+	spin_unlock_int_restore(&cache->lock, enabled);
 	return ptr;
 }
 
-void *slab_cache_alloc(struct slab_cache *cache)
+static void slab_lockless_free(struct slab_cache *cache, void *ptr)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	struct slab *slab = slab_page_slab(addr_page(pa(ptr)));
+	struct list *node = (struct list *)((char *)ptr + cache->link_offs);
+
+	while (1) {
+		const unsigned long tid = slab_cpu_tid(cpu);
+
+		if (*(struct slab *volatile *)&cpu->slab != slab)
+			break;
+
+		struct list *head = slab_cpu_head(cpu);
+
+		node->next = head;
+		if (slab_cpu_cmpxchg(&cpu->freelist, head, tid, node)) {
+			percpu_counter_inc(&cache->stats.frees);
+			return;
+		}
+	}
+
+	const int enabled = spin_lock_int_save(&cache->lock);
+
+	slab_cpu_push(cache, ptr);
+	percpu_counter_inc(&cache->stats.frees);
+	spin_unlock_int_restore(&cache->lock, enabled);
+}
+
+/* Returns all objects from magazines back to slabs. */
+static void slab_cache_flush(struct slab_cache *cache)
 {
+	struct slab_cpu *cpu = &cache->cpu;
+	struct slab_depot *depot = &cache->depot;
+	struct list_head list;
+	struct list_head *head = &list;
+
+	if (cache->flags & SLAB_LOCKLESS) {
+		const int enabled = spin_lock_int_save(&cache->lock);
+
+		slab_cpu_deactivate(cache);
+		spin_unlock_int_restore(&cache->lock, enabled);
+		return;
+	}
+
+	if (depot->mag_class < 0)
+		return;
+
+	list_init(&list);
+
 	const int enabled = spin_lock_int_save(&cache->lock);
-	void *ptr = __slab_cache_alloc(cache);
 
+	if (cpu->loaded)
+		list_add(&cpu->loaded->ll, &list);
+	if (cpu->previous)
+		list_add(&cpu->previous->ll, &list);
+	cpu->loaded = 0;
+	cpu->previous = 0;
+	list_splice(&depot->full, &list);
+	list_splice(&depot->empty, &list);
+
+	for (struct list_head *ptr = head->next; ptr != head;) {
+		struct slab_magazine *mag = (struct slab_magazine *)ptr;
+
+		ptr = ptr->next;
+		while (mag->rounds)
+			__slab_cache_free(cache, mag->round[--mag->rounds]);
+		slab_magazine_free(mag);
+	}
 	spin_unlock_int_restore(&cache->lock, enabled);
+}
+
+void *slab_cache_alloc(struct slab_cache *cache)
+{
+	if (cache->flags & SLAB_LOCKLESS)
+		return slab_lockless_alloc(cache);
+
+	const int enabled = local_int_save();
+	void *ptr = 0;
+
+	if (cache->depot.mag_class >= 0)
+		ptr = slab_cpu_alloc(cache);
+
+	if (!ptr) {
+		spin_lock(&cache->lock);
+		ptr = __slab_cache_alloc(cache);
+		spin_unlock(&cache->lock);
+	}
+	if (ptr)
+		percpu_counter_inc(&cache->stats.allocs);
+	local_int_restore(enabled);
 	return ptr;
 }
 
-static void __slab_cache_free(struct slab_cache *cache, void *ptr)
+void slab_cache_free(struct slab_cache *cache, void *ptr)
 {
-	const size_t bytes = (size_t)PAGE_SIZE << cache->slab_order;
-	const uintptr_t addr = ~(bytes - 1) & (uintptr_t)ptr;
+	if (cache->flags & SLAB_LOCKLESS) {
+		slab_lockless_free(cache, ptr);
+		return;
+	}
 
-	struct slab *slab = slab_get_meta(cache, (void *)addr);
+	const int enabled = local_int_save();
 
-	list_del(&slab->ll);
-	slab_free(slab, ptr);
+	if (cache->depot.mag_class < 0 || !slab_cpu_free(cache, ptr)) {
+		spin_lock(&cache->lock);
+		__slab_cache_free(cache, ptr);
+		spin_unlock(&cache->lock);
+	}
+	percpu_counter_inc(&cache->stats.frees);
+	local_int_restore(enabled);
+}
 
-	if (slab->size == cache->slab_size)
-		list_add(&slab->ll, &cache->empty);
+/**
+ * Bulk routines use only objects the CPU magazines already have (or room
+ * they have), the rest goes directly to/from slabs under one lock. In the
+ * lockless mode they just take the slow path for the whole batch.
+ **/
+size_t slab_cache_alloc_bulk(struct slab_cache *cache, size_t count,
+			void **ptrs)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	const int enabled = local_int_save();
+	size_t got = 0;
+
+	if (cache->depot.mag_class >= 0) {
+		struct slab_magazine *mags[] = {cpu->loaded, cpu->previous};
+
+		for (int i = 0; i != 2; ++i) {
+			struct slab_magazine *mag = mags[i];
+
+			while (mag && mag->rounds && got != count)
+				ptrs[got++] = mag->round[--mag->rounds];
+		}
+		cpu->alloc_hits += got;
+		cpu->alloc_misses += count - got;
+	}
+
+	if (got != count) {
+		spin_lock(&cache->lock);
+		if (cache->flags & SLAB_LOCKLESS) {
+			while (got != count) {
+				void *ptr = slab_cpu_pop(cache);
+
+				if (!ptr)
+					break;
+				ptrs[got++] = ptr;
+			}
+		} else {
+			got += __slab_cache_alloc_bulk(cache, count - got,
+						ptrs + got);
+		}
+		spin_unlock(&cache->lock);
+	}
+	percpu_counter_add(&cache->stats.allocs, got);
+	local_int_restore(enabled);
+	return got;
+}
+
+void slab_cache_free_bulk(struct slab_cache *cache, size_t count,
+			void **ptrs)
+{
+	struct slab_cpu *cpu = &cache->cpu;
+	const int enabled = local_int_save();
+	size_t done = 0;
+
+	if (cache->depot.mag_class >= 0) {
+		struct slab_magazine *mags[] = {cpu->loaded, cpu->previous};
+
+		for (int i = 0; i != 2; ++i) {
+			struct slab_magazine *mag = mags[i];
+
+			while (mag && !slab_magazine_full(mag) && done != count)
+				mag->round[mag->rounds++] = ptrs[done++];
+		}
+		cpu->free_hits += done;
+		cpu->free_misses += count - done;
+	}
+
+	if (done != count) {
+		spin_lock(&cache->lock);
+		while (done != count) {
+			if (cache->flags & SLAB_LOCKLESS)
+				slab_cpu_push(cache, ptrs[done++]);
+			else
+				__slab_cache_free(cache, ptrs[done++]);
+		}
+		spin_unlock(&cache->lock);
+	}
+	percpu_counter_add(&cache->stats.frees, count);
+	local_int_restore(enabled);
+}
+
+static int kmalloc_shift(size_t size)
+{
+	int shift = KMALLOC_MIN_SHIFT;
+
+	while (((size_t)1 << shift) < size)
+		++shift;
+	return shift;
+}
+
+void *kmalloc(size_t size)
+{
+	if (size <= ((size_t)1 << KMALLOC_MAX_SHIFT)) {
+		const int shift = kmalloc_shift(size);
+
+		return slab_cache_alloc(&kmalloc_cache[shift - KMALLOC_MIN_SHIFT]);
+	}
+
+	const int order = kmalloc_shift(size) - PAGE_BITS;
+
+	if (order > buddy_max_order())
+		return 0;
+
+	struct page *page = __buddy_alloc(order, 0);
+
+	if (!page)
+		return 0;
+
+	slab_page_set(page, order, ((uintptr_t)order << 1) | 1);
+	return va(page_addr(page));
+}
+
+void kfree(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	struct page *page = addr_page(pa(ptr));
+	struct slab_cache *cache = slab_page_cache(page);
+
+	if (cache)
+		slab_cache_free(cache, ptr);
 	else
-		list_add(&slab->ll, &cache->partial);
+		__buddy_free(page, slab_page_order(page));
 }
 
-void slab_cache_free(struct slab_cache *cache, void *ptr)
+static void slab_cache_show(struct file *file, struct slab_cache *cache)
 {
+	/* List counters must be consistent, other counters may be racy. */
+	const long allocs = percpu_counter_sum(&cache->stats.allocs);
+	const long frees = percpu_counter_sum(&cache->stats.frees);
 	const int enabled = spin_lock_int_save(&cache->lock);
+	const struct slab_stats stats = cache->stats;
+	const struct slab_cpu cpu = cache->cpu;
+	/* the CPU slab is not on the lists */
+	const unsigned long frozen = cache->cpu.slab != 0;
 
-	__slab_cache_free(cache, ptr);
 	spin_unlock_int_restore(&cache->lock, enabled);
+
+	const unsigned long slabs = stats.full + stats.partial + stats.empty +
+				frozen;
+	const unsigned long hits = cpu.alloc_hits + cpu.free_hits;
+	const unsigned long ops = hits + cpu.alloc_misses + cpu.free_misses;
+
+	ramfs_printf(file, "%s %ld %lu %lu %lu %lu %lu %lu %lu %ld %ld %lu "
+				"%lu ", cache->name,
+				allocs - frees,
+				slabs * cache->slab_size,
+				(unsigned long)cache->obj_size,
+				(unsigned long)cache->slab_size,
+				1ul << cache->slab_order,
+				stats.full, stats.partial, stats.empty,
+				allocs, frees,
+				stats.created, stats.destroyed);
+	ramfs_printf(file, "%lu %lu %lu %lu %lu\n",
+				cpu.alloc_hits, cpu.alloc_misses,
+				cpu.free_hits, cpu.free_misses,
+				ops ? hits * 100 / ops : 0);
+}
+
+void slab_show(struct file *file)
+{
+	struct list_head *head = &slab_caches;
+
+	ramfs_printf(file, "name inuse objs objsize objperslab pagesperslab "
+				"full partial empty allocs frees "
+				"created destroyed allochits allocmisses "
+				"freehits freemisses hitrate\n");
+
+	spin_lock(&slab_caches_lock);
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next)
+		slab_cache_show(file, (struct slab_cache *)((char *)ptr -
+					offsetof(struct slab_cache, link)));
+	spin_unlock(&slab_caches_lock);
+}
+
+
+/**
+ * Colouring benchmark: a cache of objects of the given size is filled
+ * with SLAB_BENCH_SLABS slabs and then we walk a chain through the first
+ * objects of all slabs over and over (every read depends on the previous
+ * one, so we measure latency, and the order is shuffled, so prefetchers
+ * don't help). Without colouring all of them start at the same offset
+ * and compete for the same cache sets: there are more of them than ways
+ * in a set of a typical L1, so reads miss more.
+ **/
+#define SLAB_BENCH_SLABS	16
+#define SLAB_BENCH_ROUNDS	1024
+
+static const char *const slab_bench_names[] = {
+	"thread", "vma", "ramfs_page"
+};
+
+static struct slab_cache slab_bench_cache;
+
+/* Returns cycles per read of a hot object or 0 if we ran out of memory. */
+static unsigned long slab_bench(size_t size, int colour)
+{
+	struct slab_cache *cache = &slab_bench_cache;
+	struct list *objs = 0;
+	void *hot[SLAB_BENCH_SLABS];
+	size_t count = 0;
+
+	slab_cache_init(cache, "slab_bench", size, SLAB_DEFAULT_ALIGN, 0, 0,
+				SLAB_NOMAGAZINE);
+	if (!colour)
+		cache->colours = 1;
+
+	for (size_t i = 0; i != SLAB_BENCH_SLABS * cache->slab_size; ++i) {
+		struct list *obj = slab_cache_alloc(cache);
+
+		if (!obj)
+			break;
+
+		struct slab *slab = slab_page_slab(addr_page(pa(obj)));
+
+		if (slab->objs == (char *)obj && count != SLAB_BENCH_SLABS) {
+			hot[count++] = obj;
+			continue;
+		}
+		obj->next = objs;
+		objs = obj;
+	}
+
+	unsigned long seed = 88172645463325252ul;
+
+	for (size_t i = count; i > 1; --i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		const size_t j = seed % i;
+		void *tmp = hot[i - 1];
+
+		hot[i - 1] = hot[j];
+		hot[j] = tmp;
+	}
+
+	for (size_t i = 0; i != count; ++i)
+		((struct list *)hot[i])->next = hot[(i + 1) % count];
+
+	const uint64_t start = rdtsc();
+	const struct list *obj = count ? hot[0] : 0;
+
+	for (size_t i = 0; obj && i != SLAB_BENCH_ROUNDS * count; ++i)
+		obj = *(struct list *const volatile *)&obj->next;
+
+	const uint64_t cycles = rdtsc() - start;
+
+	while (objs) {
+		struct list *obj = objs;
+
+		objs = obj->next;
+		slab_cache_free(cache, obj);
+	}
+	for (size_t i = 0; i != count; ++i)
+		slab_cache_free(cache, hot[i]);
+	slab_cache_release(cache);
+
+	if (count != SLAB_BENCH_SLABS)
+		return 0;
+	return cycles / (SLAB_BENCH_ROUNDS * SLAB_BENCH_SLABS);
+}
+
+/* Returns object size of the cache with the given name or 0. */
+static size_t slab_cache_size(const char *name)
+{
+	struct list_head *head = &slab_caches;
+	size_t size = 0;
+
+	spin_lock(&slab_caches_lock);
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		const struct slab_cache *cache = (struct slab_cache *)
+			((char *)ptr - offsetof(struct slab_cache, link));
+
+		if (!strcmp(cache->name, name)) {
+			size = cache->obj_size;
+			break;
+		}
+	}
+	spin_unlock(&slab_caches_lock);
+	return size;
+}
+
+void slab_bench_show(struct file *file)
+{
+	const size_t count = sizeof(slab_bench_names) /
+				sizeof(slab_bench_names[0]);
+
+	ramfs_printf(file, "name objsize colours plain coloured\n");
+	for (size_t i = 0; i != count; ++i) {
+		const size_t size = slab_cache_size(slab_bench_names[i]);
+
+		if (!size)
+			continue;
+
+		const unsigned long plain = slab_bench(size, 0);
+		const unsigned long coloured = slab_bench(size, 1);
+
+		ramfs_printf(file, "%s %lu %lu %lu %lu\n",
+					slab_bench_names[i],
+					(unsigned long)size,
+					(unsigned long)slab_bench_cache.colours,
+					plain, coloured);
+	}
+}
+
+
+static void slab_reap(void)
+{
+	struct list_head *head = &slab_caches;
+
+	spin_lock(&slab_caches_lock);
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct slab_cache *cache = (struct slab_cache *)((char *)ptr -
+					offsetof(struct slab_cache, link));
+
+		slab_cache_trim(cache, cache->reap_keep);
+	}
+	spin_unlock(&slab_caches_lock);
+}
+
+/* Called from the timer interrupt handler, see time.h. */
+static void slab_reap_tick(struct timer *timer)
+{
+	(void) timer;
+
+	const int enabled = spin_lock_int_save(&slab_reap_lock);
+
+	if (!slab_reap_pending) {
+		slab_reap_pending = 1;
+		notify_one(&slab_reap_cv);
+	}
+	spin_unlock_int_restore(&slab_reap_lock, enabled);
+}
+
+static int kslabd(void *unused)
+{
+	(void) unused;
+
+	while (1) {
+		const int enabled = spin_lock_int_save(&slab_reap_lock);
+
+		while (!slab_reap_pending)
+			condition_wait_spin_int(&slab_reap_cv, &slab_reap_lock);
+		slab_reap_pending = 0;
+		spin_unlock_int_restore(&slab_reap_lock, enabled);
+
+		slab_reap();
+	}
+	return 0;
+}
+
+void slab_reap_setup(void)
+{
+	spin_setup(&slab_reap_lock);
+	condition_setup(&slab_reap_cv);
+
+	struct thread *thread = thread_create(&kslabd, 0);
+
+	if (!thread) {
+		printf("Failed to create slab reaper thread\n");
+		while (1);
+	}
+
+	thread_start(thread);
+	slab_reap_timer.period = SLAB_REAP_TICKS;
+	slab_reap_timer.fn = &slab_reap_tick;
+	timer_add(&slab_reap_timer);
+}
+
+static int slab_cpu_has_cx16(void)
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+
+	__asm__ ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (ecx & (1u << 13)) != 0;
+}
+
+void slab_setup(void)
+{
+	spin_setup(&slab_caches_lock);
+	slab_lockless_supported = slab_cpu_has_cx16();
+
+	/* Descriptors are small, so this cache keeps them on-slab. */
+	slab_cache_init(&slab_meta_cache, "slab", sizeof(struct slab),
+				sizeof(void *), 0, 0, SLAB_NOMAGAZINE);
+
+	for (int i = 0; i != SLAB_MAG_CLASSES; ++i)
+		slab_cache_init(&slab_magazine_cache[i], slab_magazine_names[i],
+					(size_t)SLAB_MAG_MIN_BYTES << i,
+					sizeof(void *), 0, 0, SLAB_NOMAGAZINE);
+
+	for (int i = 0; i != KMALLOC_CACHES; ++i)
+		slab_cache_setup(&kmalloc_cache[i], kmalloc_names[i],
+					(size_t)1 << (i + KMALLOC_MIN_SHIFT));
 }
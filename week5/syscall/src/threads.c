@@ -4,14 +4,25 @@
 #include <ints.h>
 #include <mm.h>
 #include <paging.h>
+#include <percpu.h>
 #include <slab.h>
 #include <string.h>
 #include <threads.h>
+#include <vmalloc.h>
 
 
 #define IOMAP_BITS	(1 << 16)
 #define IOMAP_WORDS	(IOMAP_BITS / sizeof(unsigned long))
 
+/**
+ * Thread descriptors are allocated and freed on every thread create/exit,
+ * so the cache is handy to compare per-CPU layers of the slab allocator:
+ * e.g. make THREAD_SLAB_FLAGS=SLAB_LOCKLESS.
+ **/
+#ifndef THREAD_SLAB_FLAGS
+#define THREAD_SLAB_FLAGS	0
+#endif
+
 struct switch_frame {
 	uint64_t rflags;
 	uint64_t r15;
@@ -37,30 +48,33 @@ struct tss {
 
 static const int TIMESLICE = 5;
 
-static struct tss tss __attribute__((aligned (PAGE_SIZE)));
-
 static struct slab_cache cache;
-static struct spinlock ready_lock;
-static struct list_head ready;
-static struct thread *current;
-static struct thread *idle;
-static int remained_time;
-static int preempt_count;
+
+/* Scheduler state is per-CPU, every CPU has its own ready queue. */
+static DEFINE_PER_CPU(struct tss, tss) __attribute__((aligned (PAGE_SIZE)));
+static DEFINE_PER_CPU(struct spinlock, ready_lock);
+static DEFINE_PER_CPU(struct list_head, ready);
+static DEFINE_PER_CPU(struct thread *, current);
+static DEFINE_PER_CPU(struct thread *, idle);
+static DEFINE_PER_CPU(int, remained_time);
+static DEFINE_PER_CPU(int, preempt_count);
 
 
 static void thread_place(struct thread *me)
 {
-	spin_lock(&current->lock);
-	if (current->state == THREAD_FINISHED) {
-		current->state = THREAD_DEAD;
-		notify_one(&current->cv);
+	struct thread *prev = this_cpu_read(current);
+
+	spin_lock(&prev->lock);
+	if (prev->state == THREAD_FINISHED) {
+		prev->state = THREAD_DEAD;
+		notify_one(&prev->cv);
 	}
-	spin_unlock(&current->lock);
+	spin_unlock(&prev->lock);
 
-	current = me;
-	remained_time = TIMESLICE;
-	tss.rsp[0] = (uint64_t)va(me->stack_phys +
-				(PAGE_SIZE << me->stack_order));
+	this_cpu_write(current, me);
+	this_cpu_write(remained_time, TIMESLICE);
+	this_cpu_ptr(&tss)->rsp[0] =
+		(uint64_t)me->stack + (PAGE_SIZE << me->stack_order);
 	cr3_write(me->mm->cr3);
 }
 
@@ -79,6 +93,15 @@ static void switch_threads(struct thread *from, struct thread *new)
 	__switch_threads(&from->context, new->context);
 }
 
+/* Lock and condition variable are not used after thread_join. */
+static void thread_ctor(void *ptr)
+{
+	struct thread *thread = ptr;
+
+	spin_setup(&thread->lock);
+	condition_setup(&thread->cv);
+}
+
 static struct thread *thread_alloc(void)
 {
 	return slab_cache_alloc(&cache);
@@ -98,23 +121,23 @@ struct thread *__thread_create(int stack_order, int (*fptr)(void *), void *arg)
 		return thread;
 
 	thread->stack_order = stack_order;
-	thread->stack_phys = buddy_alloc(stack_order);
+	thread->stack = vmalloc(PAGE_SIZE << stack_order);
 
-	if (!thread->stack_phys) {
+	if (!thread->stack) {
 		thread_free(thread);
 		return 0;
 	}
 
 	thread->mm = mm_create();
 	if (!thread->mm) {
-		buddy_free(thread->stack_phys, stack_order);
+		vfree(thread->stack);
 		thread_free(thread);
 		return 0;
 	}
 
 	const size_t stack_size = PAGE_SIZE << stack_order;
 
-	char *ptr = va(thread->stack_phys);
+	char *ptr = thread->stack;
 	struct frame *regs =
 		(struct frame *)(ptr + stack_size - sizeof(*regs));
 	struct switch_frame *frame =
@@ -137,8 +160,6 @@ struct thread *__thread_create(int stack_order, int (*fptr)(void *), void *arg)
 	regs->rsp = (uint64_t)ptr + stack_size;
 	regs->rip = (uint64_t)&__thread_exit;
 
-	spin_setup(&thread->lock);
-	condition_setup(&thread->cv);
 	thread->context = frame;
 	thread->regs = regs;
 	return thread;
@@ -152,11 +173,12 @@ struct thread *thread_create(int (*fptr)(void *), void *arg)
 
 void thread_start(struct thread *thread)
 {
-	const int enabled = spin_lock_int_save(&ready_lock);
+	struct spinlock *lock = this_cpu_ptr(&ready_lock);
+	const int enabled = spin_lock_int_save(lock);
 
 	thread->state = THREAD_ACTIVE;
-	list_add_tail(&thread->ll, &ready);
-	spin_unlock_int_restore(&ready_lock, enabled);
+	list_add_tail(&thread->ll, this_cpu_ptr(&ready));
+	spin_unlock_int_restore(lock, enabled);
 }
 
 void thread_wake(struct thread *thread)
@@ -166,13 +188,13 @@ void thread_wake(struct thread *thread)
 
 struct thread *thread_current(void)
 {
-	return current;
+	return this_cpu_read(current);
 }
 
 
 void thread_block(void)
 {
-	struct thread *me = current;
+	struct thread *me = this_cpu_read(current);
 	const int enabled = spin_lock_int_save(&me->lock);
 
 	me->state = THREAD_BLOCKED;
@@ -181,7 +203,7 @@ void thread_block(void)
 
 void thread_exit(int ret)
 {
-	struct thread *me = current;
+	struct thread *me = this_cpu_read(current);
 	const int enabled = spin_lock_int_save(&me->lock);
 
 	me->retval = ret;
@@ -205,7 +227,7 @@ void thread_join(struct thread *thread, int *ret)
 
 void thread_destroy(struct thread *thread)
 {
-	buddy_free(thread->stack_phys, thread->stack_order);
+	vfree(thread->stack);
 	mm_release(thread->mm);
 	thread_free(thread);
 }
@@ -215,7 +237,7 @@ void preempt_disable(void)
 {
 	const int enabled = local_int_save();
 
-	++preempt_count;
+	this_cpu_inc(preempt_count);
 	local_int_restore(enabled);
 }
 
@@ -223,38 +245,41 @@ void preempt_enable(void)
 {
 	const int enabled = local_int_save();
 
-	--preempt_count;
+	this_cpu_dec(preempt_count);
 	local_int_restore(enabled);
 }
 
 
 void schedule(void)
 {
-	struct thread *me = current;
+	struct thread *me = this_cpu_read(current);
+	struct thread *idle_thread = this_cpu_read(idle);
+	struct list_head *queue = this_cpu_ptr(&ready);
+	struct spinlock *lock = this_cpu_ptr(&ready_lock);
 	struct thread *next = 0;
 
 	const int enabled = local_int_save();
 
 	/* check if preemptition enabled */
-	if (preempt_count) {
+	if (this_cpu_read(preempt_count)) {
 		local_int_restore(enabled);
 		return;
 	}
 
 	/* check the next in the list */
-	spin_lock(&ready_lock);
-	if (!list_empty(&ready)) {
-		next = (struct thread *)ready.next;
+	spin_lock(lock);
+	if (!list_empty(queue)) {
+		next = (struct thread *)queue->next;
 		list_del(&next->ll);
 	}
-	spin_unlock(&ready_lock);
+	spin_unlock(lock);
 
 	/**
 	 * if there is no next and the current thread is about to block
 	 * use a special idle thread
 	 **/
 	if (me->state != THREAD_ACTIVE && !next)
-		next = idle;
+		next = idle_thread;
 
 	if (!next) {
 		thread_place(me);
@@ -266,10 +291,10 @@ void schedule(void)
 	 * if the current thread is still active and not the special idle
 	 * thread, then add it to the end of the ready queue
 	 **/
-	spin_lock(&ready_lock);
-	if (me->state == THREAD_ACTIVE && me != idle)
-		list_add_tail(&me->ll, &ready);
-	spin_unlock(&ready_lock);
+	spin_lock(lock);
+	if (me->state == THREAD_ACTIVE && me != idle_thread)
+		list_add_tail(&me->ll, queue);
+	spin_unlock(lock);
 
 	switch_threads(me, next);
 	thread_place(me);
@@ -278,10 +303,10 @@ void schedule(void)
 
 void scheduler_tick(void)
 {
-	if (remained_time)
-		--remained_time;
+	if (this_cpu_read(remained_time))
+		this_cpu_dec(remained_time);
 
-	if (remained_time <= 0)
+	if (this_cpu_read(remained_time) <= 0)
 		schedule();
 }
 
@@ -290,6 +315,11 @@ void scheduler_idle(void)
 	local_int_enable();
 	while (1) {
 		schedule();
+
+		/* use spare time to prepare zeroed pages before halting */
+		if (buddy_zero_refill())
+			continue;
+
 		__asm__ ("hlt");
 	}
 }
@@ -323,11 +353,12 @@ static void tss_setup(void)
 {
 	const int tss_index = TSS_SEL >> 3;
 	uint64_t *gdt = gdt_base();
+	struct tss *cpu_tss = this_cpu_ptr(&tss);
 	struct tss_desc desc;
 
-	tss.iomap_base = offsetof(struct tss, iomap);
-	memset(tss.iomap, 0xff, sizeof(tss.iomap));
-	tss_desc_setup(&desc, &tss);
+	cpu_tss->iomap_base = offsetof(struct tss, iomap);
+	memset(cpu_tss->iomap, 0xff, sizeof(cpu_tss->iomap));
+	tss_desc_setup(&desc, cpu_tss);
 	memcpy(&gdt[tss_index], &desc, sizeof(desc));
 	tr_write(TSS_SEL);
 }
@@ -339,19 +370,22 @@ void scheduler_setup(void)
 	static struct mm mm;
 
 	main.state = THREAD_ACTIVE;
-	main.stack_phys = pa(bootstrap_stack_top) - PAGE_SIZE;
+	main.stack = bootstrap_stack_top - PAGE_SIZE;
 	main.stack_order = 0;
 
+	mutex_setup(&mm.lock);
 	list_init(&mm.vmas);
 	mm.cr3 = initial_cr3;
 	mm.pt = addr_page(initial_cr3);
 
 	main.mm = &mm;
-	current = &main;
-	idle = &main;
-
-	spin_setup(&ready_lock);
-	list_init(&ready);
-	slab_cache_setup(&cache, sizeof(struct thread));
+	this_cpu_write(current, &main);
+	this_cpu_write(idle, &main);
+
+	spin_setup(this_cpu_ptr(&ready_lock));
+	list_init(this_cpu_ptr(&ready));
+	__slab_cache_setup(&cache, "thread", sizeof(struct thread),
+				SLAB_DEFAULT_ALIGN, &thread_ctor, 0,
+				THREAD_SLAB_FLAGS);
 	tss_setup();
 }
@@ -4,6 +4,7 @@
 #include <time.h>
 #include <apic.h>
 #include <ints.h>
+#include <lock.h>
 
 
 static const uint32_t TIMER_PERIODIC = (1 << 17);
@@ -11,8 +12,55 @@ static const uint32_t TIMER_DIV128 = 10;
 static const uint32_t TIMER_INIT = 262144;
 
 
+/* Timers might be added before time_setup, so the list is static. */
+static struct list_head timers = {&timers, &timers};
+static struct spinlock timers_lock;
+static volatile unsigned long ticks;
+
+
+void timer_add(struct timer *timer)
+{
+	const int enabled = spin_lock_int_save(&timers_lock);
+
+	timer->expires = ticks + timer->period;
+	list_add_tail(&timer->ll, &timers);
+	spin_unlock_int_restore(&timers_lock, enabled);
+}
+
+void timer_del(struct timer *timer)
+{
+	const int enabled = spin_lock_int_save(&timers_lock);
+
+	list_del(&timer->ll);
+	spin_unlock_int_restore(&timers_lock, enabled);
+}
+
+unsigned long time_ticks(void)
+{
+	return ticks;
+}
+
+static void timer_run(void)
+{
+	struct list_head *head = &timers;
+	const int enabled = spin_lock_int_save(&timers_lock);
+	const unsigned long now = ++ticks;
+
+	for (struct list_head *ptr = head->next; ptr != head;
+				ptr = ptr->next) {
+		struct timer *timer = (struct timer *)ptr;
+
+		if ((long)(now - timer->expires) < 0)
+			continue;
+		timer->expires = now + timer->period;
+		timer->fn(timer);
+	}
+	spin_unlock_int_restore(&timers_lock, enabled);
+}
+
 static void timer_handler(void)
 {
+	timer_run();
 	scheduler_tick();
 }
 
@@ -29,5 +77,6 @@ static void local_apic_timer_setup(void)
 
 void time_setup(void)
 {
+	spin_setup(&timers_lock);
 	local_apic_timer_setup();
 }
@@ -0,0 +1,355 @@
+#include <vmalloc.h>
+#include <buddy.h>
+#include <list.h>
+#include <memory.h>
+#include <mutex.h>
+#include <paging.h>
+#include <print.h>
+#include <slab.h>
+
+
+/* Pages allocated/mapped at once, see buddy_alloc_bulk. */
+#define VMAP_BATCH	64
+
+/**
+ * Freed areas are not reused until the TLB is flushed, we do it once
+ * for the whole lot when it gets this many pages (or when we run out of
+ * address space) instead of on every vfree.
+ **/
+#define VMAP_LAZY_MAX	1024
+
+
+/**
+ * Areas are kept in treaps (cartesian trees) ordered by address: one of
+ * free areas and one of busy areas. In the free treap max is the size of
+ * the largest area in the subtree, so we find the lowest area large
+ * enough in O(log N) without looking at every free area.
+ **/
+struct vmap_area {
+	struct list_head ll;
+	struct vmap_area *left;
+	struct vmap_area *right;
+	uintptr_t begin;
+	uintptr_t end;
+	size_t max;
+	unsigned long prio;
+};
+
+static struct slab_cache vmap_cache;
+static struct mutex vmap_mtx;
+static struct vmap_area *vmap_free;
+static struct vmap_area *vmap_busy;
+
+/* Freed areas waiting for the TLB flush. */
+static struct list_head vmap_lazy;
+static size_t vmap_lazy_pages;
+
+static unsigned long vmap_seed = 88172645463325252ul;
+
+
+static unsigned long vmap_random(void)
+{
+	vmap_seed ^= vmap_seed << 13;
+	vmap_seed ^= vmap_seed >> 7;
+	vmap_seed ^= vmap_seed << 17;
+	return vmap_seed;
+}
+
+static void va_update(struct vmap_area *va)
+{
+	size_t max = va->end - va->begin;
+
+	if (va->left && va->left->max > max)
+		max = va->left->max;
+	if (va->right && va->right->max > max)
+		max = va->right->max;
+	va->max = max;
+}
+
+/* Splits tree into areas below addr (left) and the rest (right). */
+static void va_split(struct vmap_area *tree, uintptr_t addr,
+			struct vmap_area **left, struct vmap_area **right)
+{
+	if (!tree) {
+		*left = *right = 0;
+		return;
+	}
+
+	if (tree->begin < addr) {
+		va_split(tree->right, addr, &tree->right, right);
+		*left = tree;
+	} else {
+		va_split(tree->left, addr, left, &tree->left);
+		*right = tree;
+	}
+	va_update(tree);
+}
+
+/* All areas of left must be below all areas of right. */
+static struct vmap_area *va_merge(struct vmap_area *left,
+			struct vmap_area *right)
+{
+	if (!left)
+		return right;
+	if (!right)
+		return left;
+
+	if (left->prio > right->prio) {
+		left->right = va_merge(left->right, right);
+		va_update(left);
+		return left;
+	}
+
+	right->left = va_merge(left, right->left);
+	va_update(right);
+	return right;
+}
+
+static void va_insert(struct vmap_area **root, struct vmap_area *va)
+{
+	struct vmap_area *left, *right;
+
+	va->left = va->right = 0;
+	va->prio = vmap_random();
+	va_update(va);
+	va_split(*root, va->begin, &left, &right);
+	*root = va_merge(va_merge(left, va), right);
+}
+
+/* Removes and returns the area starting at addr, 0 if there is none. */
+static struct vmap_area *va_remove(struct vmap_area **root, uintptr_t addr)
+{
+	struct vmap_area *left, *va, *right;
+
+	va_split(*root, addr, &left, &right);
+	va_split(right, addr + 1, &va, &right);
+	*root = va_merge(left, right);
+	return va;
+}
+
+static struct vmap_area *va_first(struct vmap_area *va)
+{
+	while (va && va->left)
+		va = va->left;
+	return va;
+}
+
+static struct vmap_area *va_last(struct vmap_area *va)
+{
+	while (va && va->right)
+		va = va->right;
+	return va;
+}
+
+/* Returns the free area with the lowest address of at least size bytes. */
+static struct vmap_area *va_find(struct vmap_area *va, size_t size)
+{
+	while (va && va->max >= size) {
+		if (va->left && va->left->max >= size)
+			va = va->left;
+		else if (va->end - va->begin >= size)
+			return va;
+		else
+			va = va->right;
+	}
+	return 0;
+}
+
+
+/* Returns va to the free treap merging it with adjacent free areas. */
+static void vmap_release(struct vmap_area *va)
+{
+	struct vmap_area *left, *right, *prev, *next;
+
+	va_split(vmap_free, va->begin, &left, &right);
+
+	prev = va_last(left);
+	if (prev && prev->end == va->begin) {
+		va_remove(&left, prev->begin);
+		va->begin = prev->begin;
+		slab_cache_free(&vmap_cache, prev);
+	}
+
+	next = va_first(right);
+	if (next && next->begin == va->end) {
+		va_remove(&right, next->begin);
+		va->end = next->end;
+		slab_cache_free(&vmap_cache, next);
+	}
+
+	vmap_free = va_merge(left, right);
+	va_insert(&vmap_free, va);
+}
+
+/**
+ * Flushes TLB and makes all lazily freed areas available again. Pages
+ * are given back to the buddy allocator right in vfree: stale TLB entries
+ * do no harm as long as nobody uses the address, and that's what we
+ * guarantee by holding the address back until the flush.
+ **/
+static void vmap_purge(void)
+{
+	struct list_head list;
+
+	if (list_empty(&vmap_lazy))
+		return;
+
+	/* Kernel mappings are not global, so reloading cr3 is enough. */
+	cr3_write(cr3_read());
+
+	list_init(&list);
+	list_splice(&vmap_lazy, &list);
+	vmap_lazy_pages = 0;
+
+	while (!list_empty(&list)) {
+		struct vmap_area *va = (struct vmap_area *)list.next;
+
+		list_del(&va->ll);
+		vmap_release(va);
+	}
+}
+
+static void vmap_lazy_free(struct vmap_area *va)
+{
+	list_add_tail(&va->ll, &vmap_lazy);
+	vmap_lazy_pages += (va->end - va->begin) >> PAGE_BITS;
+	if (vmap_lazy_pages >= VMAP_LAZY_MAX)
+		vmap_purge();
+}
+
+/* Takes size bytes of the address space, returns 0 if there is no room. */
+static struct vmap_area *vmap_alloc(size_t size)
+{
+	struct vmap_area *va = slab_cache_alloc(&vmap_cache);
+
+	if (!va)
+		return 0;
+
+	struct vmap_area *free = va_find(vmap_free, size);
+
+	if (!free) {
+		vmap_purge();
+		free = va_find(vmap_free, size);
+	}
+
+	if (!free) {
+		slab_cache_free(&vmap_cache, va);
+		return 0;
+	}
+
+	va_remove(&vmap_free, free->begin);
+	va->begin = free->begin;
+	va->end = free->begin + size;
+
+	if (free->end == va->end) {
+		slab_cache_free(&vmap_cache, free);
+	} else {
+		free->begin = va->end;
+		va_insert(&vmap_free, free);
+	}
+
+	va_insert(&vmap_busy, va);
+	return va;
+}
+
+/* Unmaps pages of the range and gives them back to the buddy allocator. */
+static void vmap_unmap(uintptr_t addr, size_t pages)
+{
+	uintptr_t phys[VMAP_BATCH];
+
+	while (pages) {
+		const size_t count = pages < VMAP_BATCH ? pages : VMAP_BATCH;
+
+		pt_unmap_kernel(addr, count, phys);
+		buddy_free_bulk(0, count, phys);
+		addr += count << PAGE_BITS;
+		pages -= count;
+	}
+}
+
+/* Returns number of pages mapped, less than pages if we ran out of memory. */
+static size_t vmap_map(uintptr_t addr, size_t pages)
+{
+	uintptr_t phys[VMAP_BATCH];
+	size_t mapped = 0;
+
+	while (mapped != pages) {
+		const size_t todo = pages - mapped;
+		const size_t count = todo < VMAP_BATCH ? todo : VMAP_BATCH;
+		const size_t got = buddy_alloc_bulk(0, 0, count, phys);
+
+		if (got != count || pt_map_kernel(addr, got, phys, PTE_WRITE)) {
+			buddy_free_bulk(0, got, phys);
+			break;
+		}
+		addr += count << PAGE_BITS;
+		mapped += count;
+	}
+	return mapped;
+}
+
+void *vmalloc(size_t size)
+{
+	const size_t pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
+
+	if (!pages)
+		return 0;
+
+	mutex_lock(&vmap_mtx);
+	struct vmap_area *va = vmap_alloc((pages + 1) << PAGE_BITS);
+
+	if (!va) {
+		mutex_unlock(&vmap_mtx);
+		return 0;
+	}
+
+	const size_t mapped = vmap_map(va->begin, pages);
+
+	if (mapped != pages) {
+		vmap_unmap(va->begin, mapped);
+		va_remove(&vmap_busy, va->begin);
+		vmap_lazy_free(va);
+		va = 0;
+	}
+	mutex_unlock(&vmap_mtx);
+
+	return va ? (void *)va->begin : 0;
+}
+
+void vfree(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	mutex_lock(&vmap_mtx);
+	struct vmap_area *va = va_remove(&vmap_busy, (uintptr_t)ptr);
+
+	if (!va) {
+		printf("vfree of unknown address %p\n", ptr);
+		while (1);
+	}
+
+	/* The last page is the guard, it's not mapped. */
+	vmap_unmap(va->begin, ((va->end - va->begin) >> PAGE_BITS) - 1);
+	vmap_lazy_free(va);
+	mutex_unlock(&vmap_mtx);
+}
+
+void vmalloc_setup(void)
+{
+	mutex_setup(&vmap_mtx);
+	list_init(&vmap_lazy);
+	slab_cache_setup(&vmap_cache, "vmap_area", sizeof(struct vmap_area));
+
+	const size_t size = VMALLOC_END - VMALLOC_BASE;
+	struct vmap_area *va = slab_cache_alloc(&vmap_cache);
+
+	if (!va || pt_prepare_kernel(VMALLOC_BASE, size)) {
+		printf("Failed to setup vmalloc area\n");
+		while (1);
+	}
+
+	va->begin = VMALLOC_BASE;
+	va->end = VMALLOC_END;
+	va_insert(&vmap_free, va);
+}